@@ -0,0 +1,263 @@
+#include "rvemu.h"
+
+/**
+ * ahead-of-time translation. the code of the program is found statically,
+ * starting from the entry point and the function symbols, every place the
+ * dispatcher can land on gets a block, and all of them are compiled into a
+ * single object. that object is stamped with a hash of the program and of
+ * the codegen header, and at startup it is linked into the code cache just
+ * like the objects of the jit, which still handles whatever was missed.
+ */
+
+#define AOT_STAMP_SYMBOL "rvemu_aot_stamp"
+
+#define STT_FUNC 2
+
+typedef struct {
+    u64 *elems;
+    u64 len;
+    u64 cap;
+} pcvec_t;
+
+static void pcvec_push(pcvec_t *v, u64 pc) {
+    if (v->len == v->cap) {
+        v->cap = v->cap ? v->cap * 2 : 1024;
+        v->elems = (u64 *)realloc(v->elems, v->cap * sizeof(u64));
+    }
+    v->elems[v->len++] = pc;
+}
+
+typedef struct {
+    u64 start;
+    u64 end;
+} range_t;
+
+typedef struct {
+    u8 *buf;
+    size_t size;
+    range_t text[8];
+    int ntext;
+    range_t *funcs;
+    u64 nfuncs;
+    u8 *seen;
+    u8 *entry;
+} program_t;
+
+static u8 *map_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) fatalf("%s: %s", path, strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) fatal(strerror(errno));
+    u8 *buf = (u8 *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) fatal(strerror(errno));
+
+    *size = st.st_size;
+    return buf;
+}
+
+/**
+ * the object only fits the program it was made from, and only an rvemu
+ * whose generated code has the same state layout.
+ */
+static u64 aot_stamp(const char *prog) {
+    size_t size;
+    u8 *buf = map_file(prog, &size);
+    u64 h = hash_bytes(HASH_SEED, buf, size);
+    munmap(buf, size);
+
+    const char *header = machine_genheader();
+    return hash_bytes(h, header, strlen(header));
+}
+
+static i64 text_index(program_t *p, u64 pc) {
+    u64 off = 0;
+    for (int i = 0; i < p->ntext; i++) {
+        if (pc >= p->text[i].start && pc + 2 <= p->text[i].end)
+            return (off + pc - p->text[i].start) / 2;
+        off += p->text[i].end - p->text[i].start;
+    }
+    return -1;
+}
+
+static void program_open(program_t *p, const char *prog) {
+    p->buf = map_file(prog, &p->size);
+    elf64_ehdr_t *ehdr = (elf64_ehdr_t *)p->buf;
+
+    u64 text_size = 0;
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        elf64_phdr_t *phdr = (elf64_phdr_t *)(p->buf + ehdr->e_phoff + i * ehdr->e_phentsize);
+        if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X)) continue;
+        if (p->ntext == ARRAY_SIZE(p->text)) fatal("too many executable segments");
+        p->text[p->ntext++] = (range_t){ phdr->p_vaddr, phdr->p_vaddr + phdr->p_filesz };
+        text_size += phdr->p_filesz;
+    }
+
+    p->seen = (u8 *)calloc(text_size / 2 + 1, 1);
+    p->entry = (u8 *)calloc(text_size / 2 + 1, 1);
+
+    if (ehdr->e_shoff == 0) return;
+
+    elf64_shdr_t *shdrs = (elf64_shdr_t *)(p->buf + ehdr->e_shoff);
+    for (i64 idx = 0; idx < ehdr->e_shnum; idx++) {
+        if (shdrs[idx].sh_type != SHT_SYMTAB) continue;
+
+        elf64_sym_t *syms = (elf64_sym_t *)(p->buf + shdrs[idx].sh_offset);
+        i64 nsyms = shdrs[idx].sh_size / sizeof(elf64_sym_t);
+        p->funcs = (range_t *)calloc(nsyms, sizeof(range_t));
+        for (i64 i = 0; i < nsyms; i++) {
+            if ((syms[i].st_info & 0xf) != STT_FUNC || text_index(p, syms[i].st_value) < 0)
+                continue;
+            p->funcs[p->nfuncs++] = (range_t){ syms[i].st_value, syms[i].st_value + syms[i].st_size };
+        }
+    }
+}
+
+static void add_entry(program_t *p, pcvec_t *entries, pcvec_t *work, u64 pc) {
+    i64 idx = text_index(p, pc);
+    if (idx < 0 || p->entry[idx]) return;
+    p->entry[idx] = true;
+    pcvec_push(entries, pc);
+    pcvec_push(work, pc);
+}
+
+/**
+ * with a symbol table, a call site only returns to code inside the same
+ * function. this keeps calls to noreturn functions at the very end of a
+ * function from turning whatever follows into an entry.
+ */
+static bool returns_within(program_t *p, u64 call, u64 ret) {
+    if (p->nfuncs == 0) return true;
+    for (u64 i = 0; i < p->nfuncs; i++) {
+        if (call >= p->funcs[i].start && call < p->funcs[i].end)
+            return ret < p->funcs[i].end;
+    }
+    return false;
+}
+
+/**
+ * walks every instruction reachable through direct control flow and collects
+ * the pcs the dispatcher looks up: the entry point, every function, the
+ * target of every call, and where calls and ecalls return to.
+ */
+static void discover(program_t *p, pcvec_t *entries) {
+    pcvec_t work = {0};
+    elf64_ehdr_t *ehdr = (elf64_ehdr_t *)p->buf;
+
+    add_entry(p, entries, &work, ehdr->e_entry);
+    for (u64 i = 0; i < p->nfuncs; i++)
+        add_entry(p, entries, &work, p->funcs[i].start);
+
+    insn_t insn = {0};
+    while (work.len > 0) {
+        u64 pc = work.elems[--work.len];
+
+        while (true) {
+            i64 idx = text_index(p, pc);
+            if (idx < 0 || p->seen[idx]) break;
+            p->seen[idx] = true;
+
+            insn_decode(&insn, *(u32 *)TO_HOST(pc));
+            u64 next = pc + (insn.rvc ? 2 : 4);
+
+            if (insn.type >= insn_beq && insn.type <= insn_bgeu) {
+                pcvec_push(&work, pc + (i64)insn.imm);
+            } else if (insn.type == insn_jal) {
+                if (insn.rd == zero) {
+                    pcvec_push(&work, pc + (i64)insn.imm);
+                } else {
+                    add_entry(p, entries, &work, pc + (i64)insn.imm);
+                    if (returns_within(p, pc, next)) add_entry(p, entries, &work, next);
+                }
+            } else if (insn.type == insn_jalr) {
+                if (insn.rd != zero && returns_within(p, pc, next))
+                    add_entry(p, entries, &work, next);
+            } else if (insn.type == insn_ecall) {
+                add_entry(p, entries, &work, next);
+            }
+
+            if (insn.cont) break;
+            pc = next;
+        }
+    }
+
+    free(work.elems);
+}
+
+static int compare_pc(const void *a, const void *b) {
+    u64 x = *(const u64 *)a, y = *(const u64 *)b;
+    return x < y ? -1 : x > y;
+}
+
+void aot_translate(machine_t *m, const char *prog, const char *out) {
+    program_t p = {0};
+    program_open(&p, prog);
+
+    pcvec_t entries = {0};
+    discover(&p, &entries);
+    qsort(entries.elems, entries.len, sizeof(u64), compare_pc);
+
+    static char buf[128] = {0};
+    str_t source = str_append(str_new(), machine_genheader());
+    sprintf(buf, "const uint64_t " AOT_STAMP_SYMBOL " = 0x%016lxULL;\n", aot_stamp(prog));
+    source = str_append(source, buf);
+
+    genopts_t opts = { .flags = GEN_SPLIT_CALLS };
+    for (u64 i = 0; i < entries.len; i++) {
+        m->state.pc = entries.elems[i];
+        source = str_append(source, machine_genblock(m, &opts));
+    }
+
+    object_t obj = compile_source(source, tier_opt);
+
+    FILE *file = fopen(out, "wb");
+    if (file == NULL) fatalf("%s: %s", out, strerror(errno));
+    if (fwrite(obj.buf, 1, obj.size, file) != obj.size || fclose(file) != 0)
+        fatalf("%s: %s", out, strerror(errno));
+
+    fprintf(stderr, "rvemu: translated %lu blocks into %s\n", entries.len, out);
+
+    free_object(&obj);
+    str_free(source);
+    free(entries.elems);
+    free(p.funcs);
+    free(p.seen);
+    free(p.entry);
+    munmap(p.buf, p.size);
+}
+
+static bool find_stamp(u8 *elfbuf, u64 *stamp) {
+    elf64_ehdr_t *ehdr = (elf64_ehdr_t *)elfbuf;
+    elf64_shdr_t *shdrs = (elf64_shdr_t *)(elfbuf + ehdr->e_shoff);
+
+    for (i64 idx = 0; idx < ehdr->e_shnum; idx++) {
+        if (shdrs[idx].sh_type != SHT_SYMTAB) continue;
+
+        elf64_sym_t *syms = (elf64_sym_t *)(elfbuf + shdrs[idx].sh_offset);
+        char *strtab = (char *)(elfbuf + shdrs[shdrs[idx].sh_link].sh_offset);
+        i64 nsyms = shdrs[idx].sh_size / sizeof(elf64_sym_t);
+        for (i64 i = 0; i < nsyms; i++) {
+            if (strcmp(strtab + syms[i].st_name, AOT_STAMP_SYMBOL) != 0) continue;
+            if (syms[i].st_shndx == 0 || syms[i].st_shndx >= ehdr->e_shnum) return false;
+            *stamp = *(u64 *)(elfbuf + shdrs[syms[i].st_shndx].sh_offset + syms[i].st_value);
+            return true;
+        }
+    }
+    return false;
+}
+
+void aot_load(machine_t *m, const char *path, const char *prog) {
+    compile_unit_t unit = {0};
+    unit.obj.buf = map_file(path, &unit.obj.size);
+
+    u64 stamp;
+    if (unit.obj.size < sizeof(elf64_ehdr_t) || *(u32 *)unit.obj.buf != *(u32 *)ELFMAG ||
+        !find_stamp(unit.obj.buf, &stamp))
+        fatalf("%s: not an object made by rvemu --aot", path);
+    if (stamp != aot_stamp(prog))
+        fatalf("%s: made for another program or another rvemu", path);
+
+    machine_link(m, &unit);
+    munmap(unit.obj.buf, unit.obj.size);
+}
@@ -1,89 +1,520 @@
+#define _GNU_SOURCE
 #include "rvemu.h"
 
 #define sys_icache_invalidate(addr, size) \
   __builtin___clear_cache((char *)(addr), (char *)(addr) + (size));
 
-static u64 hash(u64 pc) {
-    return pc % CACHE_ENTRY_SIZE;
+/**
+ * the thresholds of --jit-policy=fixed. the adaptive policy starts from
+ * them and moves them between the bounds below, see cache_adapt().
+ */
+#define CACHE_HOT_COUNT   1000
+#define CACHE_TIER2_COUNT 100000
+#define CACHE_HOT_MIN     50
+#define CACHE_HOT_MAX     20000
+#define CACHE_TIER2_MIN   5000
+#define CACHE_TIER2_MAX   2000000
+#define CACHE_REGION_REF  16                  // tier 1 instructions the tier 2 threshold is meant for
+#define CACHE_ADAPT_EVERY 1024                // cache_enter() calls between two looks at the clock
+#define CACHE_DECAY_NS    (10 * 1000 * 1000) // counters are halved this often
+
+// the pc of empty entries, of the table and of the jump and inline caches.
+// no instruction is at an odd pc, pc 0 is cached like any other.
+#define CACHE_NO_PC 1
+
+// fibonacci hashing, the top bits of the product depend on all of the pc.
+static inline u64 hash(cache_t *cache, u64 pc) {
+    return (pc * 0x9e3779b97f4a7c15ULL) >> cache->shift;
+}
+
+static void cache_table_init(cache_t *cache, u64 cap) {
+    cache->pcs = (u64 *)malloc(cap * sizeof(u64));
+    for (u64 i = 0; i < cap; i++) cache->pcs[i] = CACHE_NO_PC;
+    cache->items = (cache_item_t *)calloc(cap, sizeof(cache_item_t));
+    cache->mask = cap - 1;
+    cache->shift = 64 - __builtin_ctzll(cap);
+    cache->count = 0;
+}
+
+/**
+ * the memory of the cache is a memfd mapped twice, next to each other so
+ * the code reaches the data pc-relative: executable and read-only where
+ * the code runs, and writable, never executable, where it is written and
+ * where its data lives. no page is ever writable and executable at once,
+ * and nothing is reprotected while the guest runs.
+ *
+ * the views are aligned to huge pages, and backed by them when the host
+ * has some reserved, or else asked to be by transparent huge pages, so
+ * hot code spread over the cache takes few itlb entries.
+ */
+static bool cache_map_fd(cache_t *cache, int fd) {
+    if (fd == -1) return false;
+    if (ftruncate(fd, cache->size) != 0) {
+        close(fd);
+        return false;
+    }
+
+    u64 len = 2 * cache->size;
+    u8 *area = (u8 *)mmap(NULL, len + CACHE_HUGE_PAGE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED) fatal(strerror(errno));
+    u8 *base = (u8 *)ROUNDUP((u64)area, CACHE_HUGE_PAGE);
+    if (base > area) munmap(area, base - area);
+    munmap(base + len, area + CACHE_HUGE_PAGE - base);
+
+    cache->jitcode = (u8 *)mmap(base, cache->size, PROT_READ | PROT_EXEC,
+                                MAP_SHARED | MAP_FIXED, fd, 0);
+    cache->rw = (u8 *)mmap(base + cache->size, cache->size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_FIXED, fd, 0);
+    close(fd);
+    if (cache->jitcode == MAP_FAILED || cache->rw == MAP_FAILED) {
+        munmap(base, len);
+        return false;
+    }
+    return true;
 }
 
-cache_t *new_cache() {
+static void cache_map(cache_t *cache) {
+    u64 size = cache->size;
+    cache->size = ROUNDUP(size, CACHE_HUGE_PAGE);
+    cache->huge = cache_map_fd(cache, memfd_create("rvemu-jit", MFD_CLOEXEC | MFD_HUGETLB));
+    if (cache->huge) return;
+
+    cache->size = size;
+    if (!cache_map_fd(cache, memfd_create("rvemu-jit", MFD_CLOEXEC))) fatal(strerror(errno));
+    madvise(cache->jitcode, 2 * cache->size, MADV_HUGEPAGE);
+}
+
+// empties the jump cache.
+static void cache_clear_jumps(cache_t *cache) {
+    for (u64 i = 0; i < JUMP_CACHE_SIZE; i++) cache->jumps[i] = (jump_t){ CACHE_NO_PC, NULL };
+}
+
+cache_t *new_cache(u64 size) {
     cache_t *cache = (cache_t *)calloc(1, sizeof(cache_t));
-    cache->jitcode = (u8 *)mmap(NULL, CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
-                          MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    cache->size = size;
+    cache_map(cache);
+    cache->data = cache->size;
+    cache_table_init(cache, CACHE_TABLE_SIZE);
+    cache->hot_count = CACHE_HOT_COUNT;
+    cache->tier2_count = CACHE_TIER2_COUNT;
+
+    cache->jumps = (jump_t *)malloc(JUMP_CACHE_SIZE * sizeof(jump_t));
+    cache_clear_jumps(cache);
+    cache->dispatch = cp_dispatch(cache);
+    cache->fixed = cache->offset;
     return cache;
 }
 
-#define MAX_SEARCH_COUNT 32
-#define CACHE_HOT_COUNT  100000
+/**
+ * the index of pc, or of the empty entry that ends its probe sequence. the table
+ * is at most half full, so the sequence is short and always ends.
+ */
+static inline u64 cache_probe(cache_t *cache, u64 pc) {
+    u64 index = hash(cache, pc);
+    while (cache->pcs[index] != pc && cache->pcs[index] != CACHE_NO_PC)
+        index = (index + 1) & cache->mask;
+    return index;
+}
 
-#define CACHE_IS_HOT (cache->table[index].hot >= CACHE_HOT_COUNT)
+/**
+ * the halvings of cache_adapt() item has missed, applied to its counter.
+ * they are counted rather than done to every entry as they happen.
+ */
+static inline void cache_decay(cache_t *cache, cache_item_t *item) {
+    u16 missed = cache->decays - item->decays;
+    item->hot = missed < 64 ? item->hot >> missed : 0;
+    item->decays = cache->decays;
+}
 
-u8 *cache_lookup(cache_t *cache, u64 pc) {
-    assert(pc != 0);
+/**
+ * an entry that only counts interpreted runs, and has counted none
+ * lately. nothing else refers to it, and it is made again as it was.
+ */
+static bool cache_cold(cache_t *cache, cache_item_t *item) {
+    if (item->tier != tier_none || item->queued != tier_none || item->epoch != 0 ||
+        item->profile != NULL || item->chain != NULL || item->ic != NULL)
+        return false;
+    cache_decay(cache, item);
+    return item->hot == 0;
+}
 
-    u64 index = hash(pc);
+// moves the entries into a table of cap entries, without the cold ones if prune.
+static void cache_rehash(cache_t *cache, u64 cap, bool prune) {
+    u64 *pcs = cache->pcs, old = cache->mask + 1;
+    cache_item_t *items = cache->items;
 
-    while (cache->table[index].pc != 0) {
-        if (cache->table[index].pc == pc) {
-            if (CACHE_IS_HOT)
-                return cache->jitcode + cache->table[index].offset;
-            break;
-        }
+    cache_table_init(cache, cap);
+    for (u64 i = 0; i < old; i++) {
+        if (pcs[i] == CACHE_NO_PC || (prune && cache_cold(cache, &items[i]))) continue;
+        u64 index = cache_probe(cache, pcs[i]);
+        cache->pcs[index] = pcs[i];
+        cache->items[index] = items[i];
+        cache->count++;
+    }
 
-        index++;
-        index = hash(index);
+    free(pcs);
+    free(items);
+}
+
+/**
+ * the entry of pc, added if there is none. it moves when the table grows.
+ * past CACHE_TABLE_MAX entries the cold ones are dropped instead, and the
+ * table only grows further if that leaves it more than a quarter full.
+ */
+static cache_item_t *cache_item(cache_t *cache, u64 pc) {
+    u64 index = cache_probe(cache, pc);
+    if (cache->pcs[index] == pc) return &cache->items[index];
+
+    u64 cap = cache->mask + 1;
+    if (2 * (cache->count + 1) > cap) {
+        if (cap >= CACHE_TABLE_MAX) cache_rehash(cache, cap, true);
+        if (4 * (cache->count + 1) > cap) cache_rehash(cache, cap * 2, false);
+        index = cache_probe(cache, pc);
     }
+    cache->pcs[index] = pc;
+    cache->items[index] = (cache_item_t){ .decays = cache->decays };
+    cache->count++;
+    return &cache->items[index];
+}
+
+/**
+ * entries into the tier 1 code of item before it is compiled again. the
+ * compile of a region costs about the same whatever its size, and a large
+ * region does more work per entry, so it gets there in fewer entries.
+ */
+static inline u64 cache_tier2_count(cache_t *cache, cache_item_t *item) {
+    if (options.jit_policy == policy_fixed || item->profile == NULL || item->profile->ninsns == 0)
+        return cache->tier2_count;
+    u64 ninsns = MIN(MAX(item->profile->ninsns, CACHE_REGION_REF / 4), CACHE_REGION_REF * 4);
+    return cache->tier2_count * CACHE_REGION_REF / ninsns;
+}
+
+static inline u8 *cache_code(cache_t *cache, u64 pc, cache_item_t *item) {
+    if (item->tier != tier_fast) return cache->jitcode + item->offset;
+    cache_decay(cache, item);
+    if (++item->hot >= cache_tier2_count(cache, item) && item->queued < tier_opt)
+        cache->promote = pc;
+    return cache->jitcode + item->offset;
+}
+
+/**
+ * the code for pc, never adds an entry. this is what runs on every exit
+ * from one block into the next.
+ */
+u8 *cache_lookup(cache_t *cache, u64 pc) {
+    u64 index = cache_probe(cache, pc);
+    cache_item_t *item = &cache->items[index];
+    if (cache->pcs[index] == CACHE_NO_PC || item->tier == tier_none) return NULL;
+    return cache_code(cache, pc, item);
+}
 
+/**
+ * the code for pc, as cache_lookup(). if there is none, one more entry into
+ * the interpreted block is counted instead, with the same probe, and *hot
+ * tells whether it is time to translate it. code at pc 0 is only ever
+ * interpreted, the translators take pc 0 for no pc at all.
+ */
+u8 *cache_enter(cache_t *cache, u64 pc, bool *hot) {
+    cache_item_t *item = cache_item(cache, pc);
+    *hot = false;
+    if (item->tier != tier_none) return cache_code(cache, pc, item);
+    if (pc == 0) return NULL;
+
+    cache_decay(cache, item);
+    item->hot = MIN(item->hot + 1, cache->hot_count);
+    *hot = item->hot >= cache->hot_count;
     return NULL;
 }
 
+/**
+ * the adaptive policy, called by the guest thread between two blocks with
+ * the jobs waiting for the compiler, or -1 when there are no compiler
+ * threads to wait for. every CACHE_DECAY_NS all the counters are halved,
+ * lazily, see cache_decay(), so they measure how often a block runs
+ * lately rather than ever: a new phase of the program gets hot as fast as
+ * the first one did, and blocks of a phase that is over stop piling up
+ * entries, and are dropped once there are too many. at the same time the
+ * thresholds follow the queue, higher when the compiler is behind and
+ * lower when it idles, which lets short programs reach the jit at all.
+ */
+void cache_adapt(cache_t *cache, i64 depth) {
+    if (options.jit_policy == policy_fixed || ++cache->ticks % CACHE_ADAPT_EVERY != 0) return;
+    u64 now = stats_now();
+    if (now - cache->decayed < CACHE_DECAY_NS) return;
+    cache->decayed = now;
+
+    cache->decays++;
+
+    if (depth > POOL_QUEUE_CAP / 4) {
+        cache->hot_count = MIN(cache->hot_count * 2, CACHE_HOT_MAX);
+        cache->tier2_count = MIN(cache->tier2_count * 2, CACHE_TIER2_MAX);
+    } else if (depth == 0) {
+        cache->hot_count = MAX(cache->hot_count / 2, CACHE_HOT_MIN);
+        cache->tier2_count = MAX(cache->tier2_count / 2, CACHE_TIER2_MIN);
+    }
+}
+
+/**
+ * drops all the code. this only happens between two blocks, from the guest
+ * thread, so none of it is running. regions still at the compiler keep
+ * their queued tier and their profile, their code refers to the profile's
+ * counters when it is linked.
+ */
+void cache_flush(cache_t *cache) {
+    stats_record(stat_flush_bytes, cache->offset - cache->fixed + cache->size - cache->data);
+    cache_ic_report(cache);
+    cache_huge_report(cache);
+
+    for (u64 i = 0; i <= cache->mask; i++) {
+        cache_item_t *item = &cache->items[i];
+        if (cache->pcs[i] == CACHE_NO_PC) continue;
+
+        if (item->queued <= item->tier) item->queued = tier_none;
+        item->tier = tier_none;
+        item->offset = 0;
+        item->hot = 0;
+        item->chain = NULL;
+        item->ic = NULL;
+        if (item->profile) item->profile->counts = NULL;
+    }
+
+    cache_clear_jumps(cache);
+    cache->offset = cache->fixed;
+    cache->data = cache->size;
+    cache->promote = 0;
+    cache->generation++;
+}
+
+bool cache_empty(cache_t *cache) {
+    return cache->offset == cache->fixed && cache->data == cache->size;
+}
+
 static inline u64 align_to(u64 val, u64 align) {
   if (align == 0) return val;
   return (val + align - 1) & ~(align - 1);
 }
 
-u8 *cache_add(cache_t *cache, u64 pc, u8 *code, size_t sz, u64 align) {
-    cache->offset = align_to(cache->offset, align);
-    assert(cache->offset + sz <= CACHE_SIZE);
-
-    u64 index = hash(pc);
-    u64 search_count = 0;
-    while (cache->table[index].pc != 0) {
-        if (cache->table[index].pc == pc) {
-            break;
+/**
+ * room for sz bytes, flushing the cache when they do not fit. callers that
+ * place several pieces check the generation before they install anything.
+ * returns the offset of the room.
+ *
+ * code grows from the start of the cache, and the data it writes from the
+ * end, at least a page apart: a store next to code that is running makes
+ * the cpu throw away everything it has decoded after it.
+ */
+static u64 cache_reserve(cache_t *cache, size_t sz, u64 align, bool data) {
+    for (int tries = 0; ; tries++) {
+        u64 start = data ? (cache->data - sz) & ~(MAX(align, 1) - 1)
+                         : align_to(cache->offset, align);
+        u64 code_end = data ? cache->offset : start + sz;
+        u64 data_start = data ? start : cache->data;
+        if (sz <= cache->data && code_end + CACHE_GAP <= data_start) {
+            if (data) cache->data = start;
+            else cache->offset = start + sz;
+            return start;
         }
 
-        index++;
-        index = hash(index);
+        if (tries > 0) fatalf("%zu bytes do not fit in the code cache", sz);
+        cache_flush(cache);
+    }
+}
+
+/**
+ * copy a section of a compiled object into the code cache. nothing refers
+ * to it until cache_insert() maps a pc to code inside it. the address is
+ * where it runs, it is written through cache_writable().
+ */
+u8 *cache_copy(cache_t *cache, u8 *code, size_t sz, u64 align) {
+    u64 start = cache_reserve(cache, sz, align, false);
+    memcpy(cache->rw + start, code, sz);
+    sys_icache_invalidate(cache->jitcode + start, sz);
+    return cache->jitcode + start;
+}
+
+/**
+ * zeroed space in the code cache, for data the code reaches pc-relative.
+ * it is in the writable view, the code stores to it as it runs.
+ */
+u8 *cache_alloc(cache_t *cache, size_t sz, u64 align) {
+    u8 *addr = cache->rw + cache_reserve(cache, sz, align, true);
+    memset(addr, 0, sz);
+    return addr;
+}
+
+// the writable address of addr, which is code or data in the cache.
+u8 *cache_writable(cache_t *cache, u8 *addr) {
+    if (addr >= cache->rw && addr < cache->rw + cache->size) return addr;
+    assert(addr >= cache->jitcode && addr < cache->jitcode + cache->size);
+    return cache->rw + (addr - cache->jitcode);
+}
+
+/**
+ * install code for pc. a region compiled again at a higher tier replaces
+ * the old code with this single store, which the guest thread makes between
+ * two blocks. a lower tier arriving late is dropped.
+ */
+void cache_insert(cache_t *cache, u64 pc, u8 *code, enum tier_t tier) {
+    assert(code >= cache->jitcode && code < cache->jitcode + cache->offset);
+
+    cache_item_t *item = cache_item(cache, pc);
+    if (item->tier > tier) return;
+
+    item->offset = code - cache->jitcode;
+    item->tier = tier;
+    item->hot = 0;
+    if (tier == tier_opt && item->chain) *item->chain = code;
+}
+
+/**
+ * the chain slot of pc, see CHAIN_SYMBOL. making it may flush the cache,
+ * like any other allocation in it.
+ */
+void **cache_chain(cache_t *cache, u64 pc) {
+    cache_item_t *item = cache_item(cache, pc);
+    if (item->chain != NULL) return item->chain;
+
+    // a flush on the way leaves item in place, only without code.
+    void **chain = (void **)cache_alloc(cache, sizeof(void *), sizeof(void *));
+    item->chain = chain;
+    if (item->tier == tier_opt) *chain = cache->jitcode + item->offset;
+    return chain;
+}
+
+/**
+ * mark a hot pc as handed to the compiler for tier, so it is not submitted
+ * again while the guest keeps running the code it has. returns false if it
+ * already was.
+ */
+bool cache_queue(cache_t *cache, u64 pc, enum tier_t tier) {
+    cache_item_t *item = cache_item(cache, pc);
+    if (item->queued >= tier) return false;
+    item->queued = tier;
+    return true;
+}
+
+profile_t *cache_profile(cache_t *cache, u64 pc) {
+    cache_item_t *item = cache_item(cache, pc);
+    if (item->profile == NULL) item->profile = new_profile();
+    return item->profile;
+}
+
+/**
+ * drops the code of pc, whose guest code has been written, see smc.c. it
+ * goes from the jump cache as well, and its chain slot leads back to
+ * machine_step(). the inline caches still have it until the next
+ * cache_invalidate_ics(), which takes every pc invalidated before it at
+ * once. code for pc that the compiler still works on is of an older
+ * epoch, and is never installed.
+ */
+void cache_invalidate(cache_t *cache, u64 pc) {
+    u64 index = cache_probe(cache, pc);
+    if (cache->pcs[index] == CACHE_NO_PC) return;
 
-        assert(++search_count <= MAX_SEARCH_COUNT);
+    cache_item_t *item = &cache->items[index];
+    item->tier = tier_none;
+    item->queued = tier_none;
+    item->offset = 0;
+    item->hot = 0;
+    item->epoch++;
+    if (item->chain) *item->chain = NULL;
+    if (item->profile) {
+        item->profile->nbranches = 0;
+        item->profile->counts = NULL;
     }
+    if (cache->promote == pc) cache->promote = 0;
 
-    memcpy(cache->jitcode + cache->offset, code, sz);
-    cache->table[index].pc = pc;
-    cache->table[index].offset = cache->offset;
-    cache->offset += sz;
-    sys_icache_invalidate(cache->jitcode + cache->table[index].offset, sz);
-    return cache->jitcode + cache->table[index].offset;
-}
-
-bool cache_hot(cache_t *cache, u64 pc) {
-    u64 index = hash(pc);
-    u64 search_count = 0;
-    while (cache->table[index].pc != 0) {
-        if (cache->table[index].pc == pc) {
-            cache->table[index].hot = MIN(++cache->table[index].hot, CACHE_HOT_COUNT);
-            return CACHE_IS_HOT;
+    jump_t *jump = &cache->jumps[(pc >> 1) % JUMP_CACHE_SIZE];
+    if (jump->pc == pc) *jump = (jump_t){ CACHE_NO_PC, NULL };
+}
+
+// empties the ways of inline caches whose code is no longer that of their pc.
+void cache_invalidate_ics(cache_t *cache) {
+    for (u64 i = 0; i <= cache->mask; i++) {
+        ic_t *ic = cache->items[i].ic;
+        if (cache->pcs[i] == CACHE_NO_PC || ic == NULL) continue;
+        for (int way = 0; way < IC_WAYS; way++) {
+            if (ic->pcs[way] == CACHE_NO_PC) continue;
+            u64 index = cache_probe(cache, ic->pcs[way]);
+            cache_item_t *item = &cache->items[index];
+            if (cache->pcs[index] != CACHE_NO_PC && item->tier == tier_opt &&
+                cache->jitcode + item->offset == ic->code[way])
+                continue;
+            ic->pcs[way] = CACHE_NO_PC;
+            ic->code[way] = NULL;
         }
+    }
+}
+
+u32 cache_epoch(cache_t *cache, u64 pc) {
+    return cache_item(cache, pc)->epoch;
+}
+
+// the inline cache of the jalr at pc, see IC_SYMBOL.
+ic_t *cache_ic(cache_t *cache, u64 pc) {
+    cache_item_t *item = cache_item(cache, pc);
+    if (item->ic == NULL) {
+        item->ic = (ic_t *)cache_alloc(cache, sizeof(ic_t), 8);
+        for (int way = 0; way < IC_WAYS; way++) item->ic->pcs[way] = CACHE_NO_PC;
+    }
+    return item->ic;
+}
+
+/**
+ * a miss of ic, which went to pc, that the dispatcher could not serve. if
+ * pc has final-tier code, which stays where it is until the next flush, it
+ * goes into the jump cache, and into ic in place of the way that was filled
+ * the longest ago.
+ */
+void cache_ic_fill(cache_t *cache, ic_t *ic, u64 pc) {
+    stats_record(stat_ic_hits, ic->hits);
+    ic->hits = 0;
+
+    u64 index = cache_probe(cache, pc);
+    cache_item_t *item = &cache->items[index];
+    if (cache->pcs[index] == CACHE_NO_PC || item->tier != tier_opt) return;
 
-        index++;
-        index = hash(index);
+    u8 *code = cache->jitcode + item->offset;
+    cache->jumps[(pc >> 1) % JUMP_CACHE_SIZE] = (jump_t){ pc, code };
+    ic->pcs[ic->next] = pc;
+    ic->code[ic->next] = code;
+    ic->next = (ic->next + 1) % IC_WAYS;
+}
 
-        assert(++search_count <= MAX_SEARCH_COUNT);
+// the hits of every inline cache since its last miss, see stat_ic_hits.
+void cache_ic_report(cache_t *cache) {
+    for (u64 i = 0; i <= cache->mask; i++) {
+        ic_t *ic = cache->items[i].ic;
+        if (cache->pcs[i] == CACHE_NO_PC || ic == NULL || ic->hits == 0) continue;
+        stats_record(stat_ic_hits, ic->hits);
+        ic->hits = 0;
     }
+}
 
-    cache->table[index].pc = pc;
-    cache->table[index].hot = 1;
-    return false;
+/**
+ * how much of the code is on huge pages, see stat_huge_bytes. transparent
+ * huge pages come and go, the kernel tells how many back the code view.
+ */
+void cache_huge_report(cache_t *cache) {
+    if (!stats_enabled) return;
+    if (cache->huge) {
+        stats_record(stat_huge_bytes, cache->offset);
+        return;
+    }
+
+    FILE *file = fopen("/proc/self/smaps", "r");
+    if (file == NULL) return;
+
+    char line[256];
+    bool found = false;
+    u64 start, end, kb = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            found = start == (u64)cache->jitcode;
+        } else if (found && sscanf(line, "ShmemPmdMapped: %lu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+    stats_record(stat_huge_bytes, MIN(kb * 1024, cache->offset));
 }
@@ -1,7 +1,10 @@
 #include "rvemu.h"
 
+#include "interp_util.h"
+
 typedef struct {
     bool gp_reg[num_gp_regs];
+    bool gp_dirty[num_gp_regs]; // written in the region, so stored back on the way out
     bool fp_reg[num_fp_regs];
 } tracer_t;
 
@@ -40,11 +43,18 @@ static str_t tracer_append_prologue(tracer_t *t, str_t s) {
     return s;
 }
 
+/**
+ * the one place a region spills to state, on its way out: state is not
+ * volatile, so clang keeps all of it in registers until here.
+ */
 static str_t tracer_append_epilogue(tracer_t *t, str_t s) {
     static char buf[128] = {0};
 
+    s = str_append(s, "    state->exit_reason = reason;\n");
+    s = str_append(s, "    state->reenter_pc = reenter;\n");
+
     for (int i = 1; i < num_gp_regs; i++) {
-        if (!t->gp_reg[i]) continue;
+        if (!t->gp_reg[i] || !t->gp_dirty[i]) continue;
         sprintf(buf, "    state->gp_regs[%d] = x%d;\n", i, i);
         s = str_append(s, buf);
     }
@@ -61,6 +71,10 @@ static str_t tracer_append_epilogue(tracer_t *t, str_t s) {
 static char funcbuf[128] = {0};
 static char funcbuf2[128] = {0};
 
+static genopts_t *genopts = NULL;
+static u64 genentry = 0;
+static ir_node_t *gennode = NULL; // the one being printed
+
 #define REG_SET_VAL(reg, val)                                 \
     if ((reg) != 0) {                                         \
         sprintf(funcbuf, "    x%d = %ldLL;\n", (reg), (val)); \
@@ -97,7 +111,7 @@ static char funcbuf2[128] = {0};
     sprintf(funcbuf, "    *(%s *)TO_HOST(%s) = (%s)" #data ";\n", (typ), (addr), (typ)); \
     s = str_append(s, funcbuf);                                                   \
 
-static str_t func_empty(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_empty(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     return s;
 }
 
@@ -109,31 +123,31 @@ static str_t func_empty(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
     tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rd, -1);  \
     return s;                                                  \
 
-static str_t func_lb(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_lb(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("int8_t");
 }
 
-static str_t func_lh(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_lh(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("int16_t");
 }
 
-static str_t func_lw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_lw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("int32_t");
 }
 
-static str_t func_ld(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_ld(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("int64_t");
 }
 
-static str_t func_lbu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_lbu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint8_t");
 }
 
-static str_t func_lhu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_lhu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint16_t");
 }
 
-static str_t func_lwu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_lwu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint32_t");
 }
 
@@ -146,61 +160,61 @@ static str_t func_lwu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u
     tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rd, -1); \
     return s;                                                 \
 
-static str_t func_addi(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_addi(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "rs1 + (int64_t)%ldLL", (i64)insn->imm)));
 }
 
-static str_t func_slli(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_slli(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "rs1 << %d", insn->imm & 0x3f)));
 }
 
-static str_t func_slti(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_slti(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "(int64_t)rs1 < (int64_t)%ldLL ? 1 : 0", (i64)insn->imm)));
 }
 
-static str_t func_sltiu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_sltiu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "rs1 < %luULL ? 1 : 0", (i64)insn->imm)))
 }
 
-static str_t func_xori(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_xori(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "rs1 ^ %ldLL", (i64)insn->imm)));
 }
 
-static str_t func_srli(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_srli(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "rs1 >> %d", insn->imm & 0x3f)));
 }
 
-static str_t func_srai(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_srai(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "(int64_t)rs1 >> %d", insn->imm & 0x3f)));
 }
 
-static str_t func_ori(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_ori(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "rs1 | %luULL", (i64)insn->imm)));
 }
 
-static str_t func_andi(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_andi(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "rs1 & %luULL", (i64)insn->imm)));
 }
 
-static str_t func_addiw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_addiw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "(int64_t)(int32_t)(rs1 + (int64_t)%ldLL)", (i64)insn->imm)));
 }
 
-static str_t func_slliw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_slliw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "(int64_t)(int32_t)(rs1 << %d)", insn->imm & 0x1f)));
 }
 
-static str_t func_srliw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_srliw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "(int64_t)(int32_t)((uint32_t)rs1 >> %d)", insn->imm & 0x1f)));
 }
 
-static str_t func_sraiw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_sraiw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((sprintf(funcbuf2, "(int64_t)((int32_t)rs1 >> %d)", insn->imm & 0x1f)));
 }
 
 #undef FUNC
 
-static str_t func_auipc(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_auipc(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     u64 val = pc + (i64)insn->imm;
     REG_SET_VAL(insn->rd, val);
 
@@ -216,19 +230,19 @@ static str_t func_auipc(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
     tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rs2, -1); \
     return s;                                                  \
 
-static str_t func_sb(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_sb(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint8_t");
 }
 
-static str_t func_sh(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_sh(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint16_t");
 }
 
-static str_t func_sw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_sw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint32_t");
 }
 
-static str_t func_sd(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_sd(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint64_t");
 }
 
@@ -241,91 +255,91 @@ static str_t func_sd(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u6
     tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rd, -1); \
     return s;                                                            \
 
-static str_t func_add(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_add(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 + rs2");
 }
 
-static str_t func_sll(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_sll(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 << (rs2 & 0x3f)");
 }
 
-static str_t func_slt(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_slt(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("((int64_t)rs1 < (int64_t)rs2) ? 1 : 0");
 }
 
-static str_t func_sltu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_sltu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
    FUNC("((uint64_t)rs1 < (uint64_t)rs2) ? 1 : 0");
 }
 
-static str_t func_xor(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_xor(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 ^ rs2");
 }
 
-static str_t func_srl(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_srl(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 >> (rs2 & 0x3f)");
 }
 
-static str_t func_or(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_or(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 | rs2");
 }
 
-static str_t func_and(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_and(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 & rs2");
 }
 
-static str_t func_mul(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_mul(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 * rs2");
 }
 
-static str_t func_sub(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_sub(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC(("rs1 - rs2"));
 }
 
-static str_t func_sra(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_sra(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC(("(int64_t)rs1 >> (rs2 & 0x3f)"));
 }
 
-static str_t func_remu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_remu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("(rs2 == 0 ? rs1 : rs1 % rs2)");
 }
 
-static str_t func_addw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_addw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("(int64_t)(int32_t)(rs1 + rs2)");
 }
 
-static str_t func_sllw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_sllw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("(int64_t)(int32_t)(rs1 << (rs2 & 0x1f))");
 }
 
-static str_t func_srlw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_srlw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("(int64_t)(int32_t)((uint32_t)rs1 >> (rs2 & 0x1f))");
 }
 
-static str_t func_mulw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_mulw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("(int64_t)(int32_t)(rs1 * rs2)");
 }
 
-static str_t func_divw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_divw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("(rs2 == 0 ? UINT64_MAX : (int32_t)((int64_t)(int32_t)rs1 / (int64_t)(int32_t)rs2))");
 }
 
-static str_t func_divuw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_divuw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("(rs2 == 0 ? UINT64_MAX : (int32_t)((uint32_t)rs1 / (uint32_t)rs2))");
 }
 
-static str_t func_remw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_remw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("(rs2 == 0 ? (int64_t)(int32_t)rs1 : (int64_t)(int32_t)((int64_t)(int32_t)rs1 % (int64_t)(int32_t)rs2))");
 }
 
-static str_t func_remuw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_remuw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("(rs2 == 0 ? (int64_t)(int32_t)(uint32_t)rs1 : (int64_t)(int32_t)((uint32_t)rs1 % (uint32_t)rs2))");
 }
 
-static str_t func_subw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_subw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("(int64_t)(int32_t)(rs1 - rs2)");
 }
 
-static str_t func_sraw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_sraw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("(int64_t)(int32_t)((int32_t)rs1 >> (rs2 & 0x1f))");
 }
 
@@ -339,7 +353,7 @@ static str_t func_sraw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
     tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rd, -1); \
     return s;                                                            \
 
-static str_t func_div(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_div(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((s = str_append(s,
         "    uint64_t rd = 0;                                   \n"
         "    if (rs2 == 0) {                                    \n"
@@ -351,7 +365,7 @@ static str_t func_div(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u
         "    }                                                  \n")));
 }
 
-static str_t func_divu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_divu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((s = str_append(s,
         "    uint64_t rd = 0;    \n"
         "    if (rs2 == 0) {     \n"
@@ -361,7 +375,7 @@ static str_t func_divu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
         "    }                   \n")));
 }
 
-static str_t func_rem(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_rem(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC((s = str_append(s,
         "    uint64_t rd = 0;                                   \n"
         "    if (rs2 == 0) {                                    \n"
@@ -375,83 +389,203 @@ static str_t func_rem(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u
 
 #undef FUNC
 
-static str_t func_lui(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_lui(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     tracer_add_gp_reg_usage(tracer, insn->rd, -1);
     REG_SET_VAL(insn->rd, (i64)insn->imm);
     return s;
 }
 
+/**
+ * tier 1 counts which way each branch goes, tier 2 turns branches that
+ * almost always go the same way into hints.
+ */
+static str_t append_branch(str_t s, const char *cond, u64 pc, u64 target_addr) {
+    const char *fmt = "    if (%s) {\n";
+    if (genopts->flags & GEN_HINTS) {
+        u64 taken, not_taken;
+        if (profile_branch(genopts->profile, pc, &taken, &not_taken) &&
+            taken + not_taken >= 100) {
+            if (taken * 10 >= (taken + not_taken) * 9)
+                fmt = "    if (__builtin_expect(%s, 1)) {\n";
+            else if (not_taken * 10 >= (taken + not_taken) * 9)
+                fmt = "    if (__builtin_expect(%s, 0)) {\n";
+        }
+    }
+
+    sprintf(funcbuf2, fmt, cond);
+    s = str_append(s, funcbuf2);
+
+    if (genopts->flags & GEN_PROFILE) {
+        u64 idx = profile_add_branch(genopts->profile, pc);
+        sprintf(funcbuf2, "        " PROFILE_SYMBOL "[%lu]++;\n", genentry, idx);
+        s = str_append(s, funcbuf2);
+        sprintf(funcbuf2, "        goto insn_%lx;\n", target_addr);
+        s = str_append(s, funcbuf2);
+        s = str_append(s, "    }\n");
+        sprintf(funcbuf2, "    " PROFILE_SYMBOL "[%lu]++;\n", genentry, idx + 1);
+        return str_append(s, funcbuf2);
+    }
+
+    sprintf(funcbuf2, "        goto insn_%lx;\n", target_addr);
+    s = str_append(s, funcbuf2);
+    return str_append(s, "    }\n");
+}
+
 #define FUNC(typ, op)                                                  \
     REG_GET(insn->rs1, rs1);                                           \
     REG_GET(insn->rs2, rs2);                                           \
     u64 target_addr = pc + (i64)insn->imm;                             \
-    sprintf(funcbuf, "    if ((%s)rs1 %s (%s)rs2) {\n", typ, op, typ); \
-    s = str_append(s, funcbuf);                                        \
-    sprintf(funcbuf, "        goto insn_%lx;\n", target_addr);         \
-    s = str_append(s, funcbuf);                                        \
-    s = str_append(s, "    }\n");                                      \
-    stack_push(stack, target_addr);                                    \
+    sprintf(funcbuf, "(%s)rs1 %s (%s)rs2", typ, op, typ);              \
+    s = append_branch(s, funcbuf, pc, target_addr);                    \
     tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rs2, -1);         \
     return s;                                                          \
 
-static str_t func_beq(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_beq(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint64_t", "==");
 }
 
-static str_t func_bne(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_bne(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint64_t", "!=");
 }
 
-static str_t func_blt(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_blt(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("int64_t", "<");
 }
 
-static str_t func_bge(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_bge(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("int64_t", ">=");
 }
 
-static str_t func_bltu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_bltu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint64_t", "<");
 }
 
-static str_t func_bgeu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_bgeu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint64_t", ">=");
 }
 
 #undef FUNC
 
-static str_t func_jalr(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+/**
+ * an exit to a pc the region does not cover, which jumps on through the
+ * chain slot of the pc once it holds code.
+ */
+static str_t append_exit(str_t s, u64 target_addr) {
+    s = str_append(s, "    reason = direct_branch;\n");
+    sprintf(funcbuf2, "    reenter = %luULL;\n", target_addr);
+    s = str_append(s, funcbuf2);
+    sprintf(funcbuf2, "    { extern chain_t " CHAIN_SYMBOL "; next = " CHAIN_SYMBOL "; }\n",
+            target_addr, target_addr);
+    s = str_append(s, funcbuf2);
+    return str_append(s, "    goto end;\n");
+}
+
+// pushes the pc a call returns to, see RET_STACK_SIZE.
+static str_t append_call(str_t s, u64 return_addr) {
+    sprintf(funcbuf2, "    { extern chain_t " CHAIN_SYMBOL ";\n", return_addr);
+    s = str_append(s, funcbuf2);
+    sprintf(funcbuf2, "      uint32_t top = (state->ret_top + 1) %% %d;\n", RET_STACK_SIZE);
+    s = str_append(s, funcbuf2);
+    sprintf(funcbuf2, "      state->rets[top].pc = %luULL;\n", return_addr);
+    s = str_append(s, funcbuf2);
+    sprintf(funcbuf2, "      state->rets[top].slot = &" CHAIN_SYMBOL ";\n", return_addr);
+    s = str_append(s, funcbuf2);
+    return str_append(s, "      state->ret_top = top; }\n");
+}
+
+static str_t func_jalr(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     u64 return_addr = pc + (insn->rvc ? 2 : 4);
     REG_GET(insn->rs1, rs1);
     REG_SET_VAL(insn->rd, return_addr);
+    if (LINK_REG(insn->rd)) s = append_call(s, return_addr);
 
-    s = str_append(s, "    state->exit_reason = indirect_branch;\n");
-    sprintf(funcbuf, "    state->reenter_pc = (rs1 + (int64_t)%ldLL) & ~(uint64_t)1;\n",
+    sprintf(funcbuf, "    uint64_t target = (rs1 + (int64_t)%ldLL) & ~(uint64_t)1;\n",
             (i64)insn->imm);
     s = str_append(s, funcbuf);
+
+    // a return pops the return stack, and goes through its slot on a hit.
+    bool ret = insn->rd == zero && LINK_REG(insn->rs1);
+    if (ret) {
+        s = str_append(s, "    uint32_t top = state->ret_top;\n");
+        sprintf(funcbuf, "    state->ret_top = (top - 1) %% %d;\n", RET_STACK_SIZE);
+        s = str_append(s, funcbuf);
+    }
+
+    if (genopts->flags & GEN_PROFILE) {
+        u64 idx = profile_add_branch(genopts->profile, pc);
+        sprintf(funcbuf, "    { uint64_t *vote = &" PROFILE_SYMBOL "[%lu];\n", genentry, idx);
+        s = str_append(s, funcbuf);
+        s = str_append(s, "      if (vote[0] == target) vote[1]++;\n");
+        s = str_append(s, "      else if (vote[1] == 0) vote[0] = target;\n");
+        s = str_append(s, "      else vote[1]--; }\n");
+    }
+
+    // the target ir_build() expects, guarded, continues the region.
+    if (gennode->target != 0) {
+        sprintf(funcbuf, "    if (__builtin_expect(target == %luULL, 1)) goto insn_%lx;\n",
+                gennode->target, gennode->target);
+        s = str_append(s, funcbuf);
+    }
+
+    s = str_append(s, "    reason = indirect_branch;\n");
+    s = str_append(s, "    reenter = target;\n");
+    if (ret) {
+        s = str_append(s, "    if (state->rets[top].pc == target) next = (chain_t)*state->rets[top].slot;\n");
+        s = str_append(s, "    if (next) goto end;\n");
+    }
+
+    // the inline cache, see IC_SYMBOL.
+    sprintf(funcbuf, "    extern ic_t " IC_SYMBOL ";\n", pc);
+    s = str_append(s, funcbuf);
+    sprintf(funcbuf, "    for (int i = 0; i < %d; i++) {\n", IC_WAYS);
+    s = str_append(s, funcbuf);
+    sprintf(funcbuf, "        if (" IC_SYMBOL ".pcs[i] == target) next = " IC_SYMBOL ".code[i];\n", pc, pc);
+    s = str_append(s, funcbuf);
+    s = str_append(s, "    }\n");
+    // hits are only counted for --stats, the store is not free.
+    if (stats_enabled) {
+        sprintf(funcbuf, "    if (next) " IC_SYMBOL ".hits++;\n", pc);
+        s = str_append(s, funcbuf);
+    }
+    sprintf(funcbuf, "    if (!next) { state->ic = &" IC_SYMBOL "; next = " DISPATCH_SYMBOL "; }\n", pc);
+    s = str_append(s, funcbuf);
     s = str_append(s, "    goto end;\n");
     s = str_append(s, "}\n");
     tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rd, -1);
     return s;
 }
 
-static str_t func_jal(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_jal(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     u64 return_addr = pc + (insn->rvc ? 2 : 4);
     u64 target_addr = pc + (i64)insn->imm;
 
     REG_SET_VAL(insn->rd, return_addr);
-    sprintf(funcbuf, "    goto insn_%lx;\n", target_addr);
-    s = str_append(s, funcbuf);
-    stack_push(stack, target_addr);
+    if (LINK_REG(insn->rd)) s = append_call(s, return_addr);
+    if (gennode->target == 0) {
+        s = append_exit(s, target_addr);
+    } else {
+        sprintf(funcbuf, "    goto insn_%lx;\n", target_addr);
+        s = str_append(s, funcbuf);
+    }
     s = str_append(s, "}\n");
 
     tracer_add_gp_reg_usage(tracer, insn->rd, -1);
     return s;
 }
 
-static str_t func_ecall(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    s = str_append(s, "    state->exit_reason = ecall;\n");
-    sprintf(funcbuf, "    state->reenter_pc = %luULL;\n", pc + 4);
+static str_t func_ecall(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    s = str_append(s, "    reason = ecall;\n");
+    sprintf(funcbuf, "    reenter = %luULL;\n", pc + 4);
+    s = str_append(s, funcbuf);
+    s = str_append(s, "    goto end;\n");
+    s = str_append(s, "}\n");
+    return s;
+}
+
+// leaves the region, so the guest goes on with whatever it wrote, see smc.c.
+static str_t func_fence_i(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    s = str_append(s, "    reason = fence_i;\n");
+    sprintf(funcbuf, "    reenter = %luULL;\n", pc + 4);
     s = str_append(s, funcbuf);
     s = str_append(s, "    goto end;\n");
     s = str_append(s, "}\n");
@@ -473,27 +607,27 @@ static str_t func_ecall(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
     }                                                  \
     return s;                                          \
 
-static str_t func_csrrw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_csrrw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC();
 }
 
-static str_t func_csrrs(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_csrrs(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC();
 }
 
-static str_t func_csrrc(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_csrrc(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC();
 }
 
-static str_t func_csrrwi(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_csrrwi(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC();
 }
 
-static str_t func_csrrsi(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_csrrsi(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC();
 }
 
-static str_t func_csrrci(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_csrrci(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC();
 }
 
@@ -508,11 +642,11 @@ static str_t func_csrrci(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack
     tracer_add_fp_reg_usage(tracer, insn->rd, -1);             \
     return s;                                                  \
 
-static str_t func_flw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_flw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint32_t", "rd | ((uint64_t)-1 << 32)");
 }
 
-static str_t func_fld(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fld(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint64_t", "rd");
 }
 
@@ -527,11 +661,11 @@ static str_t func_fld(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u
     tracer_add_fp_reg_usage(tracer, insn->rs2, -1);            \
     return s;                                                  \
 
-static str_t func_fsw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fsw(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint32_t");
 }
 
-static str_t func_fsd(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fsd(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("uint64_t");
 }
 
@@ -545,19 +679,19 @@ static str_t func_fsd(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u
     tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rs3, insn->rd, -1); \
     return s;                                                                       \
 
-static str_t func_fmadd_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fmadd_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 * rs2 + rs3");
 }
 
-static str_t func_fmsub_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fmsub_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 * rs2 - rs3");
 }
 
-static str_t func_fnmsub_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fnmsub_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("-(rs1 * rs2) + rs3");
 }
 
-static str_t func_fnmadd_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fnmadd_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("-(rs1 * rs2) - rs3");
 }
 
@@ -571,19 +705,19 @@ static str_t func_fnmadd_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *sta
     tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rs3, insn->rd, -1);  \
     return s;                                                                        \
 
-static str_t func_fmadd_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fmadd_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 * rs2 + rs3");
 }
 
-static str_t func_fmsub_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fmsub_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 * rs2 - rs3");
 }
 
-static str_t func_fnmsub_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fnmsub_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("-(rs1 * rs2) + rs3");
 }
 
-static str_t func_fnmadd_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fnmadd_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("-(rs1 * rs2) - rs3");
 }
 
@@ -596,33 +730,33 @@ static str_t func_fnmadd_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *sta
     tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rd, -1); \
     return s;                                                            \
 
-static str_t func_fadd_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fadd_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 + rs2");
 }
 
-static str_t func_fsub_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fsub_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 - rs2");
 }
 
-static str_t func_fmul_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fmul_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 * rs2");
 }
 
-static str_t func_fdiv_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fdiv_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 / rs2");
 }
 
-static str_t func_fmin_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fmin_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 < rs2 ? rs1 : rs2");
 }
 
-static str_t func_fmax_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fmax_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 > rs2 ? rs1 : rs2");
 }
 
 #undef FUNC
 
-static str_t func_fcvt_s_w(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fcvt_s_w(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(float)(int32_t)rs1", f);
     tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
@@ -630,7 +764,7 @@ static str_t func_fcvt_s_w(str_t s, insn_t *insn, tracer_t *tracer, stack_t *sta
     return s;
 }
 
-static str_t func_fcvt_s_wu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fcvt_s_wu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(float)(uint32_t)rs1", f);
     tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
@@ -638,7 +772,7 @@ static str_t func_fcvt_s_wu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *st
     return s;
 }
 
-static str_t func_fcvt_d_w(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fcvt_d_w(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(double)(int32_t)rs1", d);
     tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
@@ -646,7 +780,7 @@ static str_t func_fcvt_d_w(str_t s, insn_t *insn, tracer_t *tracer, stack_t *sta
     return s;
 }
 
-static str_t func_fcvt_d_wu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fcvt_d_wu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(double)(uint32_t)rs1", d);
     tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
@@ -654,7 +788,7 @@ static str_t func_fcvt_d_wu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *st
     return s;
 }
 
-static str_t func_fmv_x_w(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fmv_x_w(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FREG_GET(insn->rs1, rs1, uint32_t, w);
     REG_SET_EXPR(insn->rd, "(int64_t)(int32_t)rs1");
     tracer_add_gp_reg_usage(tracer, insn->rd, -1);
@@ -662,7 +796,7 @@ static str_t func_fmv_x_w(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stac
     return s;
 }
 
-static str_t func_fmv_w_x(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fmv_w_x(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(uint32_t)rs1", w);
     tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
@@ -670,7 +804,7 @@ static str_t func_fmv_w_x(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stac
     return s;
 }
 
-static str_t func_fmv_x_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fmv_x_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FREG_GET(insn->rs1, rs1, uint64_t, v);
     REG_SET_EXPR(insn->rd, "rs1");
     tracer_add_gp_reg_usage(tracer, insn->rd, -1);
@@ -679,7 +813,7 @@ static str_t func_fmv_x_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stac
 }
 
 
-static str_t func_fmv_d_x(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fmv_d_x(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "rs1", v);
     tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
@@ -695,15 +829,15 @@ static str_t func_fmv_d_x(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stac
     tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rs2, -1); \
     return s;                                                  \
 
-static str_t func_feq_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_feq_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 == rs2");
 }
 
-static str_t func_flt_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_flt_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 < rs2");
 }
 
-static str_t func_fle_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fle_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 <= rs2");
 }
 
@@ -717,21 +851,21 @@ static str_t func_fle_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
     tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rs2, -1); \
     return s;                                                  \
 
-static str_t func_feq_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_feq_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 == rs2");
 }
 
-static str_t func_flt_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_flt_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 < rs2");
 }
 
-static str_t func_fle_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fle_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 <= rs2");
 }
 
 #undef FUNC
 
-static str_t func_fcvt_s_l(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fcvt_s_l(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(float)(int64_t)rs1", f);
     tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
@@ -739,7 +873,7 @@ static str_t func_fcvt_s_l(str_t s, insn_t *insn, tracer_t *tracer, stack_t *sta
     return s;
 }
 
-static str_t func_fcvt_s_lu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fcvt_s_lu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(float)(uint64_t)rs1", f);
     tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
@@ -754,47 +888,47 @@ static str_t func_fcvt_s_lu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *st
     tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rd, -1); \
     return s;                                                            \
 
-static str_t func_fadd_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fadd_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 + rs2");
 }
 
-static str_t func_fsub_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fsub_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 - rs2");
 }
 
-static str_t func_fmul_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fmul_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 * rs2");
 }
 
-static str_t func_fdiv_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fdiv_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 / rs2");
 }
 
-static str_t func_fmin_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fmin_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 < rs2 ? rs1 : rs2");
 }
 
-static str_t func_fmax_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fmax_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FUNC("rs1 > rs2 ? rs1 : rs2");
 }
 
 #undef FUNC
 
-static str_t func_fcvt_s_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fcvt_s_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FREG_GET(insn->rs1, rs1, double, d);
     FREG_SET_EXPR(insn->rd, "(float)rs1", f);
     tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rd, -1);
     return s;
 }
 
-static str_t func_fcvt_d_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fcvt_d_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     FREG_GET(insn->rs1, rs1, float, f);
     FREG_SET_EXPR(insn->rd, "(double)rs1", d);
     tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rd, -1);
     return s;
 }
 
-static str_t func_fcvt_d_l(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fcvt_d_l(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(double)(int64_t)rs1", d);
     tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
@@ -802,7 +936,7 @@ static str_t func_fcvt_d_l(str_t s, insn_t *insn, tracer_t *tracer, stack_t *sta
     return s;
 }
 
-static str_t func_fcvt_d_lu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+static str_t func_fcvt_d_lu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(double)(uint64_t)rs1", d);
     tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
@@ -810,102 +944,146 @@ static str_t func_fcvt_d_lu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *st
     return s;
 }
 
-#define FUNC() \
-    s = str_append(s, "    state->exit_reason = interp;\n");   \
-    sprintf(funcbuf, "    state->reenter_pc = %luULL;\n", pc); \
-    s = str_append(s, funcbuf);                                \
-    s = str_append(s, "    goto end;\n");                      \
-    s = str_append(s, "}\n");                                  \
-    insn->cont = true;                                         \
-    return s;                                                  \
+#define FUNC(expr)                                                    \
+    REG_GET(insn->rs1, rs1);                                          \
+    REG_GET(insn->rs2, rs2);                                          \
+    REG_SET_EXPR(insn->rd, expr);                                     \
+    tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rd, -1); \
+    return s;                                                         \
 
-static str_t func_mulh(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_mulh(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC("mulh(rs1, rs2)");
 }
 
-static str_t func_mulhsu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_mulhsu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC("mulhsu(rs1, rs2)");
 }
 
-static str_t func_mulhu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_mulhu(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC("mulhu(rs1, rs2)");
 }
 
-static str_t func_fsqrt_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+#undef FUNC
+
+static str_t func_fsqrt_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FREG_GET(insn->rs1, rs1, float, f);
+    FREG_SET_EXPR(insn->rd, "__builtin_sqrtf(rs1)", f);
+    tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rd, -1);
+    return s;
 }
 
-static str_t func_fcvt_w_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fsqrt_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FREG_GET(insn->rs1, rs1, double, d);
+    FREG_SET_EXPR(insn->rd, "__builtin_sqrt(rs1)", d);
+    tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rd, -1);
+    return s;
 }
 
-static str_t func_fcvt_wu_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+// see INTERP_HELPERS, the rounding mode is a constant clang folds.
+#define FUNC(typ, field, helper)                                   \
+    FREG_GET(insn->rs1, rs1, typ, field);                          \
+    sprintf(funcbuf2, helper "(rs1, %d)", insn->rm);               \
+    REG_SET_EXPR(insn->rd, funcbuf2);                              \
+    tracer_add_gp_reg_usage(tracer, insn->rd, -1);                 \
+    tracer_add_fp_reg_usage(tracer, insn->rs1, -1);                \
+    return s;                                                      \
+
+static str_t func_fcvt_w_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(float, f, "fcvt_w");
 }
 
-static str_t func_fcvt_w_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fcvt_wu_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(float, f, "fcvt_wu");
 }
 
-static str_t func_fcvt_wu_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fcvt_w_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(double, d, "fcvt_w");
 }
 
-static str_t func_fclass_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fcvt_wu_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(double, d, "fcvt_wu");
 }
 
-static str_t func_fclass_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fcvt_l_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(float, f, "fcvt_l");
 }
 
-static str_t func_fcvt_l_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fcvt_lu_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(float, f, "fcvt_lu");
 }
 
-static str_t func_fcvt_lu_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fcvt_l_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(double, d, "fcvt_l");
 }
 
-static str_t func_fcvt_l_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fcvt_lu_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(double, d, "fcvt_lu");
 }
 
-static str_t func_fcvt_lu_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+#undef FUNC
+
+static str_t func_fclass_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FREG_GET(insn->rs1, rs1, uint32_t, w);
+    REG_SET_EXPR(insn->rd, "f32_classify(rs1)");
+    tracer_add_gp_reg_usage(tracer, insn->rd, -1);
+    tracer_add_fp_reg_usage(tracer, insn->rs1, -1);
+    return s;
 }
 
-static str_t func_fsgnj_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fclass_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FREG_GET(insn->rs1, rs1, uint64_t, v);
+    REG_SET_EXPR(insn->rd, "f64_classify(rs1)");
+    tracer_add_gp_reg_usage(tracer, insn->rd, -1);
+    tracer_add_fp_reg_usage(tracer, insn->rs1, -1);
+    return s;
 }
 
-static str_t func_fsgnjn_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+// single results are nan-boxed, as the interpreter does.
+#define FUNC(n, x)                                                                      \
+    FREG_GET(insn->rs1, rs1, uint32_t, w);                                              \
+    FREG_GET(insn->rs2, rs2, uint32_t, w);                                              \
+    sprintf(funcbuf2, "(uint64_t)fsgnj32(rs1, rs2, %d, %d) | ((uint64_t)-1 << 32)", n, x); \
+    FREG_SET_EXPR(insn->rd, funcbuf2, v);                                               \
+    tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rd, -1);                \
+    return s;                                                                           \
+
+static str_t func_fsgnj_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(0, 0);
 }
 
-static str_t func_fsgnjx_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fsgnjn_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(1, 0);
 }
 
-static str_t func_fsgnj_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fsgnjx_s(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(0, 1);
 }
 
-static str_t func_fsgnjn_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+#undef FUNC
+
+#define FUNC(n, x)                                                           \
+    FREG_GET(insn->rs1, rs1, uint64_t, v);                                   \
+    FREG_GET(insn->rs2, rs2, uint64_t, v);                                   \
+    sprintf(funcbuf2, "fsgnj64(rs1, rs2, %d, %d)", n, x);                    \
+    FREG_SET_EXPR(insn->rd, funcbuf2, v);                                    \
+    tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rd, -1);     \
+    return s;                                                                \
+
+static str_t func_fsgnj_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(0, 0);
 }
 
-static str_t func_fsgnjx_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fsgnjn_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(1, 0);
 }
 
-static str_t func_fsqrt_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC();
+static str_t func_fsgnjx_d(str_t s, insn_t *insn, tracer_t *tracer, u64 pc) {
+    FUNC(0, 1);
 }
 
 #undef FUNC
 
-typedef str_t (func_t)(str_t, insn_t *, tracer_t *, stack_t *, u64);
+typedef str_t (func_t)(str_t, insn_t *, tracer_t *, u64);
 
 static func_t *funcs[] = {
     func_lb,
@@ -916,7 +1094,7 @@ static func_t *funcs[] = {
     func_lhu,
     func_lwu,
     func_empty, // fence
-    func_empty, // fence_i
+    func_fence_i,
     func_addi,
     func_slli,
     func_slti,
@@ -1043,6 +1221,31 @@ static func_t *funcs[] = {
     func_fmv_d_x,
 };
 
+/**
+ * the generated code does not include any headers: the few types and limits
+ * it needs come from the compiler's predefined macros, which saves clang from
+ * preprocessing the system headers for every block and lets the in-process
+ * backend compile without any header search paths.
+ */
+#define STRINGIFY_(...) #__VA_ARGS__
+#define STRINGIFY(...)  STRINGIFY_(__VA_ARGS__)
+
+#define CODEGEN_TYPES                                   \
+    "typedef __INT8_TYPE__ int8_t;                  \n" \
+    "typedef __INT16_TYPE__ int16_t;                \n" \
+    "typedef __INT32_TYPE__ int32_t;                \n" \
+    "typedef __INT64_TYPE__ int64_t;                \n" \
+    "typedef __UINT8_TYPE__ uint8_t;                \n" \
+    "typedef __UINT16_TYPE__ uint16_t;              \n" \
+    "typedef __UINT32_TYPE__ uint32_t;              \n" \
+    "typedef __UINT64_TYPE__ uint64_t;              \n" \
+    "#define INT64_MAX __INT64_MAX__                \n" \
+    "#define INT64_MIN (-__INT64_MAX__ - 1)         \n" \
+    "#define UINT64_MAX __UINT64_MAX__              \n" \
+    "#define bool _Bool                             \n" \
+    "#define true 1                                 \n" \
+    "#define false 0                                \n" \
+
 #define CODEGEN_PROLOGUE                                \
     "#define OFFSET 0x088800000000ULL               \n" \
     "#define TO_HOST(addr) (addr + OFFSET)          \n" \
@@ -1052,6 +1255,7 @@ static func_t *funcs[] = {
     "   indirect_branch,                            \n" \
     "   interp,                                     \n" \
     "   ecall,                                      \n" \
+    "   fence_i,                                    \n" \
     "};                                             \n" \
     "typedef union {                                \n" \
     "    uint64_t v;                                \n" \
@@ -1061,65 +1265,122 @@ static func_t *funcs[] = {
     "} fp_reg_t;                                    \n" \
     "typedef struct {                               \n" \
     "    enum exit_reason_t exit_reason;            \n" \
+    "    uint32_t exit_request;                     \n" \
     "    uint64_t reenter_pc;                       \n" \
+    "    void *ic;                                  \n" \
     "    uint64_t gp_regs[32];                      \n" \
     "    fp_reg_t fp_regs[32];                      \n" \
     "    uint64_t pc;                               \n" \
-    "    uint32_t fcsr;                             \n" \
+    "    struct {                                   \n" \
+    "        uint64_t pc;                           \n" \
+    "        void **slot;                           \n" \
+    "    } rets[" STRINGIFY(RET_STACK_SIZE) "];      \n" \
+    "    uint32_t ret_top;                          \n" \
     "} state_t;                                     \n" \
-    "void start(volatile state_t *restrict state) { \n" \
-
-#define CODEGEN_EPILOGUE "}"
-
-str_t machine_genblock(machine_t *m) {
+    "typedef void (*chain_t)(state_t *restrict);   \n" \
+    "#if __has_attribute(musttail)                  \n" \
+    "#define CHAIN(next) if (next && !__atomic_load_n(&state->exit_request, __ATOMIC_RELAXED)) \\\n" \
+    "    __attribute__((musttail)) return next(state) \n" \
+    "#else                                          \n" \
+    "#define CHAIN(next)                            \n" \
+    "#endif                                         \n" \
+    "typedef struct {                               \n" \
+    "    uint64_t pcs[" STRINGIFY(IC_WAYS) "];       \n" \
+    "    chain_t code[" STRINGIFY(IC_WAYS) "];       \n" \
+    "    uint64_t hits;                             \n" \
+    "    uint64_t next;                             \n" \
+    "} ic_t;                                        \n" \
+    "extern void " DISPATCH_SYMBOL "(state_t *restrict); \n" \
+    STRINGIFY(INTERP_HELPERS) "\n"
+
+#define CODEGEN_EPILOGUE "}\n"
+
+/**
+ * everything the block functions share. it is emitted once at the top of
+ * each translation unit, however many blocks the unit holds.
+ */
+const char *machine_genheader() {
+    return CODEGEN_TYPES CODEGEN_PROLOGUE;
+}
+
+/**
+ * prints the region ir_build() finds from the pc of m as C, after the
+ * passes of ir_optimize().
+ */
+str_t machine_genblock(machine_t *m, genopts_t *opts) {
+    u64 start = stats_now();
     DECLEAR_STATIC_STR(body);
+    genopts = opts;
+    genentry = m->state.pc;
 
-    static stack_t stack = {0};
-    stack_reset(&stack);
-
-    static set_t set;
-    set_reset(&set);
+    static ir_region_t region;
+    ir_build(m, opts, &region);
+    ir_optimize(&region);
 
     static tracer_t tracer;
     tracer_reset(&tracer);
 
-    stack_push(&stack, m->state.pc);
-
-    u64 pc = -1;
-
-    while (stack_pop(&stack, &pc)) {
-        if (!set_add(&set, pc)) {
-            continue;
-        }
+    for (u64 i = 0; i < region.len; i++) {
+        ir_node_t *node = &region.nodes[i];
+        insn_t *insn = &node->insn;
+        u64 pc = node->pc;
+        gennode = node;
 
         static char buf[128] = {0};
-        static insn_t insn = {0};
-
         sprintf(buf, "insn_%lx: {\n", pc);
         body = str_append(body, buf);
 
-        u32 data = *(u32 *)TO_HOST(pc);
-        insn_decode(&insn, data);
-        body = funcs[insn.type](body, &insn, &tracer, &stack, pc);
+        if (node->exit) {
+            body = append_exit(body, pc);
+            body = str_append(body, "}\n");
+            continue;
+        }
+
+        if (node->dead) {
+            // nothing to print, see ir_drop_dead().
+        } else if (node->known) {
+            tracer_add_gp_reg_usage(&tracer, insn->rd, -1);
+            str_t s = body;
+            REG_SET_VAL(insn->rd, (i64)node->value);
+            body = s;
+        } else {
+            body = funcs[insn->type](body, insn, &tracer, pc);
+        }
+        if (!node->dead && ir_writes_gp(insn)) tracer.gp_dirty[insn->rd] = true;
 
-        if (insn.cont) continue;
+        if (insn->cont) continue;
 
-        pc += (insn.rvc ? 2 : 4);
-        sprintf(buf, "    goto insn_%lx;\n", pc);
-        body = str_append(body, buf);
+        // the next instruction is printed right below, no need to jump there.
+        pc += (insn->rvc ? 2 : 4);
+        if (i + 1 == region.len || region.nodes[i + 1].pc != pc) {
+            sprintf(buf, "    goto insn_%lx;\n", pc);
+            body = str_append(body, buf);
+        }
         body = str_append(body, "}\n");
-        stack_push(&stack, pc);
     }
 
+    static char name[128] = {0};
     DECLEAR_STATIC_STR(source);
-    source = str_append(source, "#include <stdint.h>\n");
-    source = str_append(source, "#include <stdbool.h>\n");
-    source = str_append(source, CODEGEN_PROLOGUE);
+    if (opts->flags & GEN_PROFILE) {
+        sprintf(name, "extern uint64_t " PROFILE_SYMBOL "[];\n", m->state.pc);
+        source = str_append(source, name);
+    }
+    sprintf(name, "void " BLOCK_SYMBOL "(state_t *restrict state) {\n",
+            m->state.pc);
+    source = str_append(source, name);
+    source = str_append(source, "    chain_t next = 0;\n");
+    source = str_append(source, "    enum exit_reason_t reason = none;\n");
+    source = str_append(source, "    uint64_t reenter = 0;\n");
     source = tracer_append_prologue(&tracer, source);
     source = str_append(source, body);
     source = str_append(source, "end:;\n");
     source = tracer_append_epilogue(&tracer, source);
+    source = str_append(source, "    CHAIN(next);\n");
     source = str_append(source, CODEGEN_EPILOGUE);
 
+    stats_record(stat_genblock_ns, stats_now() - start);
+    stats_record(stat_source_bytes, str_len(source));
+    stats_record(stat_region_insns, region.ninsns);
+    if ((opts->flags & GEN_PROFILE) && opts->profile != NULL) opts->profile->ninsns = region.ninsns;
     return source;
 }
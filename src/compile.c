@@ -1,94 +1,309 @@
+#define _GNU_SOURCE
 #include "rvemu.h"
 
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
 #define BINBUF_CAP 64 * 1024
 
-static u8 elfbuf[BINBUF_CAP] = {0};
+extern char **environ;
+
+static char *const clang_argv[][8] = {
+    [tier_fast] = { "clang", "-O1", "-c", "-xc", "-o", "-", "-", NULL },
+    [tier_opt]  = { "clang", "-O3", "-c", "-xc", "-o", "-", "-", NULL },
+};
+
+#ifdef RVEMU_LIBCLANG
+static const int opt_level[] = {
+    [tier_fast] = 1,
+    [tier_opt]  = 3,
+};
+#endif
+
+#ifndef RVEMU_LIBCLANG
+/**
+ * spawn clang with argv, feed it input (if any) and return what it wrote
+ * to stdout, or NULL if it failed, or if it could not be run or talked to.
+ * this is called from the compiler threads and from the compile server, so
+ * it must not touch any global state, nor give up on the process: clang
+ * gets its own pipes instead of the process's stdout, and every pipe is
+ * close-on-exec so that a concurrently spawned clang cannot inherit (and
+ * keep open) the other end of ours.
+ */
+static u8 *run_clang(char *const argv[], str_t input, size_t *sz) {
+    int inp[2], outp[2];
+    if (pipe2(inp, O_CLOEXEC) != 0) return NULL;
+    if (pipe2(outp, O_CLOEXEC) != 0) {
+        close(inp[0]);
+        close(inp[1]);
+        return NULL;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, inp[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, outp[1], STDOUT_FILENO);
 
-u8 *machine_compile(machine_t *m, str_t source) {
-    int saved_stdout = dup(STDOUT_FILENO);
-    int outp[2];
+    // the SIGPIPE rvemu ignores would be inherited, clang gets it back.
+    posix_spawnattr_t attr;
+    sigset_t sigdef;
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigdef);
+    sigaddset(&sigdef, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigdef);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
 
-    if (pipe(outp) != 0) fatal("cannot make a pipe");
-    dup2(outp[1], STDOUT_FILENO);
+    pid_t pid;
+    int err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(inp[0]);
     close(outp[1]);
+    if (err != 0) {
+        close(inp[1]);
+        close(outp[0]);
+        return NULL;
+    }
 
-    FILE *f;
-    f = popen("clang -O3 -c -xc -o /dev/stdout -", "w");
-    if (f == NULL) fatal("cannot compile program");
-    fwrite(source, 1, str_len(source), f);
-    pclose(f);
-    fflush(stdout);
-
-    (void) read(outp[0], elfbuf, BINBUF_CAP);
-    dup2(saved_stdout, STDOUT_FILENO);
-
-    elf64_ehdr_t *ehdr = (elf64_ehdr_t *)elfbuf;
-
-    /**
-     * for some instructions, clang will generate a corresponding .rodata section.
-     * this means we need to write a mini-linker that puts the .rodata section into
-     * memory, takes its actual address, and uses symbols and relocations to apply
-     * it back to the corresponding location in the .text section.
-     */
-
-    i64 text_idx = 0, symtab_idx = 0, rela_idx = 0, rodata_idx = 0;
-    {
-        u64 shstr_shoff = ehdr->e_shoff + ehdr->e_shstrndx * sizeof(elf64_shdr_t);
-        elf64_shdr_t *shstr_shdr = (elf64_shdr_t *)(elfbuf + shstr_shoff);
-        assert(ehdr->e_shnum != 0);
-
-        for (i64 idx = 0; idx < ehdr->e_shnum; idx++) {
-            u64 shoff = ehdr->e_shoff + idx * sizeof(elf64_shdr_t);
-            elf64_shdr_t *shdr = (elf64_shdr_t *)(elfbuf + shoff);
-            char *str = (char *)(elfbuf + shstr_shdr->sh_offset + shdr->sh_name);
-            if (strcmp(str, ".text") == 0) text_idx = idx;
-            if (strcmp(str, ".rela.text") == 0) rela_idx = idx;
-            if (strncmp(str, ".rodata.", strlen(".rodata.")) == 0) rodata_idx = idx;
-            if (strcmp(str, ".symtab") == 0) symtab_idx = idx;
+    // clang reads the whole translation unit before it writes anything,
+    // so writing everything first and reading afterwards cannot deadlock.
+    bool ok = true;
+    size_t len = input ? str_len(input) : 0;
+    for (size_t off = 0; off < len;) {
+        ssize_t n = write(inp[1], input + off, len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            ok = false;
+            break;
         }
+        off += n;
     }
+    close(inp[1]);
 
-    assert(text_idx != 0 && symtab_idx != 0);
-
-    u64 text_shoff = ehdr->e_shoff + text_idx * sizeof(elf64_shdr_t);
-    elf64_shdr_t *text_shdr = (elf64_shdr_t *)(elfbuf + text_shoff);
+    size_t cap = BINBUF_CAP;
+    u8 *buf = malloc(cap);
+    *sz = 0;
+    while (ok) {
+        if (*sz == cap) buf = realloc(buf, cap *= 2);
+        ssize_t n = read(outp[0], buf + *sz, cap - *sz);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) ok = false;
+        if (n <= 0) break;
+        *sz += n;
+    }
+    close(outp[0]);
 
-    if (rela_idx == 0 || rodata_idx == 0) {
-        return cache_add(m->cache, m->state.pc, elfbuf + text_shdr->sh_offset,
-                         text_shdr->sh_size, text_shdr->sh_addralign);
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            ok = false;
+            break;
+        }
+    }
+    if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || *sz == 0) {
+        free(buf);
+        return NULL;
     }
 
-    u64 text_addr = 0;
-    {
-        u64 shoff = ehdr->e_shoff + rodata_idx * sizeof(elf64_shdr_t);
-        elf64_shdr_t *shdr = (elf64_shdr_t *)(elfbuf + shoff);
-        cache_add(m->cache, m->state.pc, elfbuf + shdr->sh_offset,
-                  shdr->sh_size, shdr->sh_addralign);
-        text_addr = (u64)cache_add(m->cache, m->state.pc, elfbuf + text_shdr->sh_offset,
-                                   text_shdr->sh_size, text_shdr->sh_addralign);
+    return buf;
+}
+#endif
+
+static u64 compiler_id = 0;
+
+/**
+ * identifies the compiler for the disk cache: the version clang reports,
+ * the flags we run it with and the header every unit starts with.
+ */
+static void compiler_id_init() {
+#ifdef RVEMU_LIBCLANG
+    const char *version = libclang_version();
+    u64 h = hash_bytes(HASH_SEED, version, strlen(version));
+#else
+    static char *const version_argv[] = { "clang", "--version", NULL };
+    size_t sz;
+    u8 *version = run_clang(version_argv, NULL, &sz);
+    if (version == NULL) fatal("cannot run clang");
+    u64 h = hash_bytes(HASH_SEED, version, sz);
+    free(version);
+#endif
+
+    for (int tier = tier_fast; tier <= tier_opt; tier++) {
+        for (int i = 0; clang_argv[tier][i]; i++)
+            h = hash_bytes(h, clang_argv[tier][i], strlen(clang_argv[tier][i]) + 1);
     }
 
-    // apply relocations to .text section.
-    {
-        u64 shoff = ehdr->e_shoff + rela_idx * sizeof(elf64_shdr_t);
-        elf64_shdr_t *shdr = (elf64_shdr_t *)(elfbuf + shoff);
-        i64 rels = shdr->sh_size / sizeof(elf64_rela_t);
+    const char *header = machine_genheader();
+    compiler_id = hash_bytes(h, header, strlen(header));
+}
 
-        u64 symtab_shoff = ehdr->e_shoff + symtab_idx * sizeof(elf64_shdr_t);
-        elf64_shdr_t *symtab_shdr = (elf64_shdr_t *)(elfbuf + symtab_shoff);
+/**
+ * whether there is a clang to run at all, without one the copy-and-patch
+ * backend is the only way to native code.
+ */
+bool compile_available() {
+#ifdef RVEMU_LIBCLANG
+    return true;
+#else
+    static char buf[PATH_MAX];
+    const char *path = getenv("PATH");
+    if (path == NULL) path = "/usr/local/bin:/usr/bin:/bin";
 
-        for (i64 idx = 0; idx < rels; idx++) {
-#ifndef __x86_64__
-            fatal("only support x86_64 for now");
+    for (const char *dir = path; ; dir++) {
+        const char *end = strchrnul(dir, ':');
+        int len = end - dir;
+        snprintf(buf, sizeof(buf), "%.*s/clang", len ? len : 1, len ? dir : ".");
+        if (access(buf, X_OK) == 0) return true;
+        if (*end == '\0') return false;
+        dir = end;
+    }
 #endif
-            elf64_rela_t *rel = (elf64_rela_t *)(elfbuf + shdr->sh_offset + idx * sizeof(elf64_rela_t));
-            assert(rel->r_type == R_X86_64_PC32);
+}
+
+/**
+ * compiles source with the flags of tier, in this process. false when the
+ * compiler rejects it, or cannot be run.
+ */
+bool compile_local(str_t source, enum tier_t tier, object_t *obj) {
+#ifdef RVEMU_LIBCLANG
+    obj->buf = libclang_compile(source, str_len(source), opt_level[tier], &obj->size);
+#else
+    obj->buf = run_clang(clang_argv[tier], source, &obj->size);
+#endif
+    return obj->buf != NULL;
+}
+
+object_t compile_source(str_t source, enum tier_t tier) {
+    u64 start = stats_now();
+    object_t obj = {0};
+    if (!server_compile(source, tier, &obj) && !compile_local(source, tier, &obj))
+        fatal("cannot compile program");
+
+    stats_record(stat_compile_ns, stats_now() - start);
+    stats_record(stat_object_bytes, obj.size);
+    return obj;
+}
+
+void free_object(object_t *obj) {
+    if (obj->shared) return;
+    if (obj->map) munmap(obj->map, obj->map_size);
+    else free(obj->buf);
+}
+
+compile_job_t *new_job(u64 pc, enum tier_t tier, str_t source) {
+    compile_job_t *job = (compile_job_t *)calloc(1, sizeof(compile_job_t));
+    job->pc = pc;
+    job->tier = tier;
+    job->source = str_append(str_new(), source);
+    return job;
+}
+
+void free_job(compile_job_t *job) {
+    str_free(job->source);
+    free(job);
+}
+
+static compile_unit_t *new_unit(object_t obj, compile_job_t *jobs, compile_unit_t *next) {
+    compile_unit_t *unit = (compile_unit_t *)calloc(1, sizeof(compile_unit_t));
+    unit->obj = obj;
+    unit->jobs = jobs;
+    unit->next = next;
+    return unit;
+}
+
+void free_unit(compile_unit_t *unit) {
+    compile_job_t *job = unit->jobs;
+    while (job != NULL) {
+        compile_job_t *next = job->next;
+        free_job(job);
+        job = next;
+    }
+    free_object(&unit->obj);
+    free(unit);
+}
+
+/**
+ * the unit for a job found in a cache. the jobs of a batch share one
+ * object, under the key of each, so a job whose object another unit
+ * already has joins that unit, and the object is linked only once.
+ */
+static compile_unit_t *add_hit(compile_unit_t *units, compile_job_t *job, object_t obj) {
+    for (compile_unit_t *unit = units; unit != NULL; unit = unit->next) {
+        if (unit->obj.size != obj.size) continue;
+        if (unit->obj.buf != obj.buf && memcmp(unit->obj.buf, obj.buf, obj.size) != 0) continue;
+        free_object(&obj);
+        job->next = unit->jobs;
+        unit->jobs = job;
+        return units;
+    }
+    return new_unit(obj, job, units);
+}
+
+/**
+ * turns a list of jobs of the same tier into objects. the jobs found in
+ * the shared or the disk cache become a unit per object, the rest are put
+ * into a single translation unit so that clang starts up, and the header is
+ * parsed, only once. what only the disk had is shared from then on, once
+ * per object.
+ */
+compile_unit_t *compile_jobs(compile_job_t *jobs) {
+    compile_unit_t *units = NULL;
+    compile_job_t *misses = jobs;
+
+    if (diskcache_enabled() || shmcache_enabled()) {
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+        pthread_once(&once, compiler_id_init);
 
-            elf64_sym_t *sym = (elf64_sym_t *)(elfbuf + symtab_shdr->sh_offset + rel->r_sym * sizeof(elf64_sym_t));
-            u32 *loc = (u32 *)(text_addr + rel->r_offset);
-            *loc = (u32)((i64)sym->st_value + rel->r_addend - (i64)rel->r_offset);
+        compile_job_t **tail = &misses;
+        for (compile_job_t *job = jobs, *next; job != NULL; job = next) {
+            next = job->next;
+            job->next = NULL;
+            job->key = hash_bytes(compiler_id, &job->tier, sizeof(job->tier));
+            job->key = hash_bytes(job->key, job->source, str_len(job->source));
+
+            object_t obj = {0};
+            if (shmcache_load(job, &obj)) {
+                units = add_hit(units, job, obj);
+                continue;
+            }
+            if (diskcache_load(job, &obj)) {
+                units = add_hit(units, job, obj);
+                continue;
+            }
+
+            *tail = job;
+            tail = &job->next;
         }
+        *tail = NULL;
+
+        for (compile_unit_t *unit = units; unit != NULL; unit = unit->next)
+            if (!unit->obj.shared) shmcache_store(unit->jobs, &unit->obj);
     }
 
-    return (u8 *)text_addr;
+    if (misses == NULL) return units;
+
+    str_t source = str_append(str_new(), machine_genheader());
+    for (compile_job_t *job = misses; job != NULL; job = job->next)
+        source = str_append(source, job->source);
+
+    object_t obj = compile_source(source, misses->tier);
+    str_free(source);
+
+    diskcache_store(misses, &obj);
+    shmcache_store(misses, &obj);
+    return new_unit(obj, misses, units);
+}
+
+u8 *machine_compile(machine_t *m, enum tier_t tier, str_t source) {
+    compile_job_t *job = new_job(m->state.pc, tier, source);
+    job->epoch = cache_epoch(m->cache, m->state.pc);
+    compile_unit_t *unit = compile_jobs(job);
+    while (unit != NULL) {
+        compile_unit_t *next = unit->next;
+        machine_link(m, unit);
+        free_unit(unit);
+        unit = next;
+    }
+    return cache_lookup(m->cache, m->state.pc);
 }
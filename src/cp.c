@@ -0,0 +1,284 @@
+#include "rvemu.h"
+
+#include <stddef.h>
+
+#include "stencils.h"
+
+/**
+ * the copy-and-patch backend. a region is translated by copying the stencil
+ * of every instruction, compiled when rvemu was built, one after the other
+ * and filling in their holes: no compiler runs, and a region is ready in
+ * microseconds instead of the milliseconds clang takes. the code is plain,
+ * each instruction loads and stores the guest registers it uses, so this is
+ * the jit of hosts without clang, or of `--jit=cp`.
+ *
+ * the region is the one machine_genblock() would make: branches and calls
+ * are followed, and every pc it does not cover ends in an exit to it,
+ * which is chained to the code of that pc, see CHAIN_SYMBOL.
+ */
+
+#define CP_MAX_INSNS  256
+#define CP_MAX_LABELS 4096
+
+typedef struct {
+    u64 pc;
+    u64 offset;
+} label_t;
+
+typedef struct {
+    u64 loc;
+    u64 pc;
+    i64 addend;
+} fixup_t;
+
+typedef struct {
+    u8 *buf;
+    u64 len;
+    u64 cap;
+    label_t labels[CP_MAX_LABELS];
+    fixup_t fixups[4 * CP_MAX_INSNS];
+    u64 nfixups;
+} cp_block_t;
+
+// what the holes of one stencil are filled with.
+typedef struct {
+    u64 pc;
+    insn_t insn;
+    u64 next;
+    u64 taken;
+    enum exit_reason_t reason;
+    u64 target;
+    insn_t *copy;
+    void **slot;
+    ic_t *ic;
+} site_t;
+
+static cp_block_t block;
+
+static label_t *label_find(u64 pc, bool add) {
+    u64 idx = hash_bytes(HASH_SEED, &pc, sizeof(pc)) % CP_MAX_LABELS;
+    while (block.labels[idx].pc != 0 && block.labels[idx].pc != pc)
+        idx = (idx + 1) % CP_MAX_LABELS;
+
+    if (block.labels[idx].pc == pc) return &block.labels[idx];
+    if (!add) return NULL;
+    block.labels[idx] = (label_t){ pc, block.len };
+    return &block.labels[idx];
+}
+
+static bool patch(u8 *loc, const cp_hole_t *hole, i64 val) {
+    val += hole->addend;
+    switch (hole->type) {
+    case R_X86_64_64:
+        *(u64 *)loc = val;
+        return true;
+    case R_X86_64_32:
+        if ((u64)val != (u32)val) return false;
+        *(u32 *)loc = (u32)val;
+        return true;
+    case R_X86_64_32S:
+        if (val != (i32)val) return false;
+        *(u32 *)loc = (u32)val;
+        return true;
+    default:
+        fatalf("unsupported relocation type %u", hole->type);
+    }
+}
+
+static void add_fixup(u64 loc, u64 pc, i64 addend) {
+    assert(block.nfixups < ARRAY_SIZE(block.fixups));
+    block.fixups[block.nfixups++] = (fixup_t){ loc, pc, addend };
+}
+
+static inline i64 reg_offset(i8 reg) {
+    return offsetof(state_t, gp_regs) + reg * sizeof(u64);
+}
+
+static u64 reserve(u64 size) {
+    if (block.len + size > block.cap) {
+        block.cap = MAX(block.cap * 2, block.len + size);
+        block.buf = (u8 *)realloc(block.buf, block.cap);
+    }
+    block.len += size;
+    return block.len - size;
+}
+
+static bool emit(cache_t *cache, const cp_stencil_t *s, site_t *site) {
+    u64 start = reserve(s->size);
+    memcpy(block.buf + start, s->code, s->size);
+
+    for (u64 i = 0; i < s->nholes; i++) {
+        const cp_hole_t *hole = &s->holes[i];
+        u8 *loc = block.buf + start + hole->offset;
+        i64 val = 0;
+
+        switch (hole->kind) {
+        case hole_rd:     val = reg_offset(site->insn.rd); break;
+        case hole_rs1:    val = reg_offset(site->insn.rs1); break;
+        case hole_rs2:    val = reg_offset(site->insn.rs2); break;
+        case hole_imm:    val = site->insn.imm; break;
+        case hole_pc:     val = site->pc; break;
+        case hole_ret:    val = site->pc + (site->insn.rvc ? 2 : 4); break;
+        case hole_target: val = site->target; break;
+        case hole_reason: val = site->reason; break;
+        case hole_insn:   val = (i64)site->copy; break;
+        case hole_interp: val = (i64)exec_insn_interp; break;
+        case hole_slot:   val = (i64)site->slot; break;
+        case hole_ic:     val = (i64)site->ic; break;
+        case hole_dispatch: val = (i64)cache->dispatch; break;
+        case hole_jumps:  val = (i64)cache->jumps; break;
+        case hole_stats:  val = stats_enabled; break;
+        case hole_next:
+            add_fixup(start + hole->offset, site->next, hole->addend);
+            continue;
+        case hole_taken:
+            add_fixup(start + hole->offset, site->taken, hole->addend);
+            continue;
+        default:
+            unreachable();
+        }
+
+        if (!patch(loc, hole, val)) return false;
+    }
+    return true;
+}
+
+static bool emit_exit(cache_t *cache, u64 pc) {
+    site_t site = { .target = pc, .slot = cache_chain(cache, pc) };
+    return emit(cache, &stencil_chain, &site);
+}
+
+// jmp rel32, for code that would fall into a pc placed elsewhere.
+static void emit_jump(u64 pc) {
+    u64 start = reserve(5);
+    block.buf[start] = 0xe9;
+    add_fixup(start + 1, pc, -4);
+}
+
+u8 *cp_translate(machine_t *m) {
+#ifndef __x86_64__
+    fatal("only support x86_64 for now");
+#endif
+    u64 start = stats_now(), generation = m->cache->generation;
+    bool empty = cache_empty(m->cache);
+    block.len = 0;
+    block.nfixups = 0;
+    memset(block.labels, 0, sizeof(block.labels));
+
+    static pcstack_t work;
+    stack_reset(&work);
+    stack_push(&work, m->state.pc);
+
+    u64 ninsns = 0;
+    u64 pc;
+    while (stack_pop(&work, &pc)) {
+        // whether the code emitted last runs on into pc.
+        bool falls = false;
+
+        while (true) {
+            if (label_find(pc, false) != NULL || ninsns == CP_MAX_INSNS) {
+                if (falls) emit_jump(pc);
+                break;
+            }
+            label_find(pc, true);
+            ninsns++;
+
+            site_t site = { .pc = pc };
+            insn_decode(&site.insn, *(u32 *)TO_HOST(pc));
+            insn_t *insn = &site.insn;
+            site.next = pc + (insn->rvc ? 2 : 4);
+            smc_watch(m, m->state.pc, pc, site.next - pc);
+
+            const cp_stencil_t *s = NULL;
+            bool ends = false;
+            switch (insn->type) {
+            case insn_beq: case insn_bne: case insn_blt:
+            case insn_bge: case insn_bltu: case insn_bgeu:
+                site.taken = pc + (i64)insn->imm;
+                if (work.top < STACK_CAP) stack_push(&work, site.taken);
+                s = op_stencils[insn->type];
+                break;
+            case insn_jal:
+                site.next = pc + (i64)insn->imm;
+                if (LINK_REG(insn->rd)) {
+                    s = &stencil_call;
+                    site.slot = cache_chain(m->cache, pc + (insn->rvc ? 2 : 4));
+                } else if (insn->rd != zero) {
+                    s = &stencil_op_jal;
+                }
+                break;
+            case insn_jalr:
+                if (LINK_REG(insn->rd)) {
+                    s = &stencil_call_jalr;
+                    site.slot = cache_chain(m->cache, pc + (insn->rvc ? 2 : 4));
+                } else if (insn->rd != zero) {
+                    s = &stencil_op_jalr;
+                } else {
+                    s = LINK_REG(insn->rs1) ? &stencil_ret : &stencil_jr;
+                }
+                site.ic = cache_ic(m->cache, pc);
+                ends = true;
+                break;
+            case insn_ecall:
+            case insn_fence_i:
+                site.reason = insn->type == insn_ecall ? ecall : fence_i;
+                site.target = site.next;
+                s = &stencil_leave;
+                ends = true;
+                break;
+            default:
+                s = op_stencils[insn->type];
+                if (s == NULL) {
+                    site.copy = (insn_t *)cache_copy(m->cache, (u8 *)insn, sizeof(insn_t), 8);
+                    s = &stencil_fallback;
+                } else if (insn->rd == zero && (insn->type < insn_sb || insn->type > insn_sd)) {
+                    // nothing to do, x0 stays zero.
+                    s = NULL;
+                }
+            }
+
+            if (s != NULL && !emit(m->cache, s, &site)) return NULL;
+            if (ends) break;
+
+            falls = s == NULL || s->falls;
+            pc = site.next;
+        }
+    }
+
+    // jumps out of the region go to exits, one per target pc.
+    for (u64 i = 0; i < block.nfixups; i++) {
+        fixup_t *f = &block.fixups[i];
+        label_t *label = label_find(f->pc, false);
+        if (label == NULL) {
+            label = label_find(f->pc, true);
+            if (!emit_exit(m->cache, f->pc)) return NULL;
+        }
+
+        i64 rel = (i64)label->offset + f->addend - (i64)f->loc;
+        assert(rel == (i32)rel);
+        *(u32 *)(block.buf + f->loc) = (u32)rel;
+    }
+
+    // a flush took the instructions of the fallbacks along, or happens now,
+    // then all of it is placed again, into an empty cache.
+    u8 *code = cache_copy(m->cache, block.buf, block.len, 16);
+    if (m->cache->generation != generation) {
+        if (empty) fatal("a region does not fit in the code cache");
+        cache_flush(m->cache);
+        return cp_translate(m);
+    }
+    cache_insert(m->cache, m->state.pc, code, tier_opt);
+
+    stats_record(stat_cp_ns, stats_now() - start);
+    stats_record(stat_code_bytes, block.len);
+    stats_record(stat_region_insns, ninsns);
+    return code;
+}
+
+// the dispatcher, see DISPATCH_SYMBOL. made once, when the cache is.
+u8 *cp_dispatch(cache_t *cache) {
+    block.len = 0;
+    site_t site = {0};
+    if (!emit(cache, &stencil_dispatch, &site)) fatal("cannot make the dispatcher");
+    return cache_copy(cache, block.buf, block.len, 16);
+}
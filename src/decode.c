@@ -1133,6 +1133,7 @@ void insn_decode(insn_t *insn, u32 data) {
             unreachable();
             case 0x60: {
                 u32 rs2 = RS2(data);
+                insn->rm = FUNCT3(data);
 
                 switch (rs2) {
                 case 0x0: /* FCVT.W.S */
@@ -1153,6 +1154,7 @@ void insn_decode(insn_t *insn, u32 data) {
             unreachable();
             case 0x61: {
                 u32 rs2 = RS2(data);
+                insn->rm = FUNCT3(data);
 
                 switch (rs2) {
                 case 0x0: /* FCVT.W.D */
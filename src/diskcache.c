@@ -0,0 +1,157 @@
+#include "rvemu.h"
+
+/**
+ * translations are stored as the object file clang produced, next to the
+ * sources of the blocks it was compiled from. an object holding several
+ * blocks is written once and hard linked under the key of each of them.
+ * the file name is only a hash, so the source is compared on load and a
+ * collision just looks like a miss. objects are linked again after
+ * loading, since the linked code depends on where it lands in the code cache.
+ */
+
+#define DISKCACHE_MAGIC 0x3243444d45565221ULL
+
+typedef struct {
+    u64 magic;
+    u64 nblocks;
+    u64 obj_size;
+} diskcache_hdr_t;
+
+typedef struct {
+    u64 key;
+    u64 source_size;
+} diskcache_block_t;
+
+static char *cache_dir = NULL;
+
+static int mkdirs(char *path) {
+    for (char *p = path + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        int ret = mkdir(path, 0755);
+        *p = '/';
+        if (ret != 0 && errno != EEXIST) return -1;
+    }
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) return -1;
+    return 0;
+}
+
+void diskcache_init(const char *dir) {
+    char *path = strdup(dir);
+    if (mkdirs(path) != 0) {
+        free(path);
+        return;
+    }
+    cache_dir = path;
+}
+
+bool diskcache_enabled() {
+    return cache_dir != NULL;
+}
+
+static void diskcache_path(char *buf, size_t len, u64 key) {
+    snprintf(buf, len, "%s/%016lx.o", cache_dir, key);
+}
+
+bool diskcache_load(compile_job_t *job, object_t *obj) {
+    if (cache_dir == NULL) return false;
+
+    char path[PATH_MAX];
+    diskcache_path(path, sizeof(path), job->key);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(diskcache_hdr_t)) {
+        close(fd);
+        return false;
+    }
+
+    u8 *map = (u8 *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    diskcache_hdr_t *hdr = (diskcache_hdr_t *)map;
+    u64 size = st.st_size;
+    u64 off = sizeof(diskcache_hdr_t);
+    bool found = false;
+
+    for (u64 i = 0; hdr->magic == DISKCACHE_MAGIC && i < hdr->nblocks; i++) {
+        if (size - off < sizeof(diskcache_block_t)) break;
+        diskcache_block_t *block = (diskcache_block_t *)(map + off);
+        off += sizeof(diskcache_block_t);
+
+        if (size - off < ROUNDUP(block->source_size, 8)) break;
+        if (block->key == job->key && block->source_size == str_len(job->source) &&
+            memcmp(map + off, job->source, block->source_size) == 0)
+            found = true;
+        off += ROUNDUP(block->source_size, 8);
+    }
+
+    if (!found || size - off != hdr->obj_size) {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    obj->buf = map + off;
+    obj->size = hdr->obj_size;
+    obj->map = map;
+    obj->map_size = st.st_size;
+    return true;
+}
+
+static bool write_all(int fd, const void *data, size_t len) {
+    const u8 *p = (const u8 *)data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * written to a temporary file and linked into place, so concurrent
+ * emulators never see a partially written entry.
+ */
+void diskcache_store(compile_job_t *jobs, object_t *obj) {
+    if (cache_dir == NULL) return;
+
+    char tmp[PATH_MAX], path[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s/.tmp.XXXXXX", cache_dir);
+    int fd = mkstemp(tmp);
+    if (fd == -1) return;
+
+    static const u8 pad[8] = {0};
+    diskcache_hdr_t hdr = {
+        .magic = DISKCACHE_MAGIC,
+        .obj_size = obj->size,
+    };
+    for (compile_job_t *job = jobs; job != NULL; job = job->next)
+        hdr.nblocks++;
+
+    bool ok = write_all(fd, &hdr, sizeof(hdr));
+    for (compile_job_t *job = jobs; ok && job != NULL; job = job->next) {
+        diskcache_block_t block = {
+            .key = job->key,
+            .source_size = str_len(job->source),
+        };
+        ok = write_all(fd, &block, sizeof(block)) &&
+             write_all(fd, job->source, block.source_size) &&
+             write_all(fd, pad, ROUNDUP(block.source_size, 8) - block.source_size);
+    }
+    ok = ok && write_all(fd, obj->buf, obj->size);
+    close(fd);
+
+    for (compile_job_t *job = jobs; ok && job != NULL; job = job->next) {
+        diskcache_path(path, sizeof(path), job->key);
+        // an existing entry under this key failed to load, replace it.
+        if (link(tmp, path) != 0 && errno == EEXIST) {
+            unlink(path);
+            link(tmp, path);
+        }
+    }
+    unlink(tmp);
+}
@@ -19,7 +19,27 @@
 #define PF_R 0x4
 
 
-#define R_X86_64_PC32 2
+#define SHT_PROGBITS 1
+#define SHT_SYMTAB   2
+#define SHT_RELA     4
+#define SHT_NOBITS   8
+
+#define SHF_WRITE 0x1
+#define SHF_ALLOC 0x2
+
+#define SHN_UNDEF 0
+#define SHN_ABS   0xfff1
+
+#define R_X86_64_NONE          0
+#define R_X86_64_64            1
+#define R_X86_64_PC32          2
+#define R_X86_64_PLT32         4
+#define R_X86_64_GOTPCREL      9
+#define R_X86_64_32            10
+#define R_X86_64_32S           11
+#define R_X86_64_PC64          24
+#define R_X86_64_GOTPCRELX     41
+#define R_X86_64_REX_GOTPCRELX 42
 
 typedef struct {
     u8 e_ident[EI_NIDENT];
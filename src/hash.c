@@ -0,0 +1,12 @@
+#include "rvemu.h"
+
+#define FNV_PRIME 0x100000001b3ULL
+
+u64 hash_bytes(u64 h, const void *data, size_t len) {
+    const u8 *p = (const u8 *)data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
@@ -325,6 +325,13 @@ static void func_jal(state_t *state, insn_t *insn) {
     state->exit_reason = direct_branch;
 }
 
+// ends the block, machine_step() drops code the guest wrote over, see smc.c.
+static void func_fence_i(state_t *state, insn_t *insn) {
+    state->exit_reason = fence_i;
+    state->reenter_pc = state->pc + 4;
+    insn->cont = true;
+}
+
 static void func_ecall(state_t *state, insn_t *insn) {
     state->exit_reason = ecall;
     state->reenter_pc = state->pc + 4;
@@ -523,19 +530,19 @@ static void func_fsgnjx_d(state_t *state, insn_t *insn) {
 #undef FUNC
 
 static void func_fcvt_w_s(state_t *state, insn_t *insn) {
-    state->gp_regs[insn->rd] = (i64)(i32)llrintf(state->fp_regs[insn->rs1].f);
+    state->gp_regs[insn->rd] = fcvt_w(state->fp_regs[insn->rs1].f, insn->rm);
 }
 
 static void func_fcvt_wu_s(state_t *state, insn_t *insn) {
-    state->gp_regs[insn->rd] = (i64)(i32)(u32)llrintf(state->fp_regs[insn->rs1].f);
+    state->gp_regs[insn->rd] = fcvt_wu(state->fp_regs[insn->rs1].f, insn->rm);
 }
 
 static void func_fcvt_w_d(state_t *state, insn_t *insn) {
-    state->gp_regs[insn->rd] = (i64)(i32)llrint(state->fp_regs[insn->rs1].d);
+    state->gp_regs[insn->rd] = fcvt_w(state->fp_regs[insn->rs1].d, insn->rm);
 }
 
 static void func_fcvt_wu_d(state_t *state, insn_t *insn) {
-    state->gp_regs[insn->rd] = (i64)(i32)(u32)llrint(state->fp_regs[insn->rs1].d);
+    state->gp_regs[insn->rd] = fcvt_wu(state->fp_regs[insn->rs1].d, insn->rm);
 }
 
 static void func_fcvt_s_w(state_t *state, insn_t *insn) {
@@ -608,27 +615,27 @@ static void func_fle_d(state_t *state, insn_t *insn) {
 #undef FUNC
 
 static void func_fclass_s(state_t *state, insn_t *insn) {
-    state->gp_regs[insn->rd] = f32_classify(state->fp_regs[insn->rs1].f);
+    state->gp_regs[insn->rd] = f32_classify(state->fp_regs[insn->rs1].w);
 }
 
 static void func_fclass_d(state_t *state, insn_t *insn) {
-    state->gp_regs[insn->rd] = f64_classify(state->fp_regs[insn->rs1].d);
+    state->gp_regs[insn->rd] = f64_classify(state->fp_regs[insn->rs1].v);
 }
 
 static void func_fcvt_l_s(state_t *state, insn_t *insn) {
-    state->gp_regs[insn->rd] = (i64)llrintf(state->fp_regs[insn->rs1].f);
+    state->gp_regs[insn->rd] = fcvt_l(state->fp_regs[insn->rs1].f, insn->rm);
 }
 
 static void func_fcvt_lu_s(state_t *state, insn_t *insn) {
-    state->gp_regs[insn->rd] = (u64)llrintf(state->fp_regs[insn->rs1].f);
+    state->gp_regs[insn->rd] = fcvt_lu(state->fp_regs[insn->rs1].f, insn->rm);
 }
 
 static void func_fcvt_l_d(state_t *state, insn_t *insn) {
-    state->gp_regs[insn->rd] = (i64)llrint(state->fp_regs[insn->rs1].d);
+    state->gp_regs[insn->rd] = fcvt_l(state->fp_regs[insn->rs1].d, insn->rm);
 }
 
 static void func_fcvt_lu_d(state_t *state, insn_t *insn) {
-    state->gp_regs[insn->rd] = (u64)llrint(state->fp_regs[insn->rs1].d);
+    state->gp_regs[insn->rd] = fcvt_lu(state->fp_regs[insn->rs1].d, insn->rm);
 }
 
 static void func_fcvt_s_l(state_t *state, insn_t *insn) {
@@ -666,7 +673,7 @@ static func_t *funcs[] = {
     func_lhu,
     func_lwu,
     func_empty, // fence
-    func_empty, // fence_i
+    func_fence_i,
     func_addi,
     func_slli,
     func_slti,
@@ -807,3 +814,12 @@ void exec_block_interp(state_t *state) {
         state->pc += insn.rvc ? 2 : 4;
     }
 }
+
+/**
+ * a single instruction that does not end the block, for the copy-and-patch
+ * backend, which has no stencil of its own for most of them.
+ */
+void exec_insn_interp(state_t *state, insn_t *insn) {
+    funcs[insn->type](state, insn);
+    state->gp_regs[zero] = 0;
+}
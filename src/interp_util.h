@@ -1,108 +1,90 @@
-inline uint64_t mulhu(uint64_t a, uint64_t b) {
-    uint64_t t;
-    uint32_t y1, y2, y3;
-    uint64_t a0 = (uint32_t)a, a1 = a >> 32;
-    uint64_t b0 = (uint32_t)b, b1 = b >> 32;
-    t = a1*b0 + ((a0*b0) >> 32);
-    y1 = t;
-    y2 = t >> 32;
-    t = a0*b1 + y1;
-    y1 = t;
-    t = a1*b1 + y2 + (t >> 32);
-    y2 = t;
-    y3 = t >> 32;
-    return ((uint64_t)y3 << 32) | y2;
-}
+/**
+ * helpers of the interpreter that translated code runs as well. they need
+ * no header and no types beyond those of CODEGEN_TYPES, and are written
+ * inside INTERP_HELPERS, whose text CODEGEN_PROLOGUE puts in front of every
+ * translation unit: both tiers run the very same code, which clang inlines.
+ */
+#define INTERP_HELPERS                                                              \
+static inline uint64_t mulhu(uint64_t a, uint64_t b) {                              \
+    return (uint64_t)((unsigned __int128)a * b >> 64);                              \
+}                                                                                   \
+                                                                                    \
+static inline uint64_t mulh(uint64_t a, uint64_t b) {                               \
+    return (uint64_t)((__int128)(int64_t)a * (int64_t)b >> 64);                     \
+}                                                                                   \
+                                                                                    \
+static inline uint64_t mulhsu(uint64_t a, uint64_t b) {                             \
+    return (uint64_t)((__int128)(int64_t)a * (__int128)b >> 64);                    \
+}                                                                                   \
+                                                                                    \
+static inline uint32_t fsgnj32(uint32_t a, uint32_t b, _Bool n, _Bool x) {          \
+    uint32_t v = x ? a : n ? 0x80000000u : 0;                                       \
+    return (a & ~0x80000000u) | ((v ^ b) & 0x80000000u);                            \
+}                                                                                   \
+                                                                                    \
+static inline uint64_t fsgnj64(uint64_t a, uint64_t b, _Bool n, _Bool x) {          \
+    uint64_t v = x ? a : n ? 0x8000000000000000ull : 0;                             \
+    return (a & ~0x8000000000000000ull) | ((v ^ b) & 0x8000000000000000ull);        \
+}                                                                                   \
+                                                                                    \
+static inline uint64_t fclass(_Bool sign, _Bool inf_or_nan, _Bool subnormal_or_zero, \
+                              _Bool frac_zero, _Bool quiet) {                       \
+    if (inf_or_nan && !frac_zero) return quiet ? 1 << 9 : 1 << 8;                   \
+    if (inf_or_nan) return sign ? 1 << 0 : 1 << 7;                                  \
+    if (subnormal_or_zero && frac_zero) return sign ? 1 << 3 : 1 << 4;              \
+    if (subnormal_or_zero) return sign ? 1 << 2 : 1 << 5;                           \
+    return sign ? 1 << 1 : 1 << 6;                                                  \
+}                                                                                   \
+                                                                                    \
+static inline uint64_t f32_classify(uint32_t v) {                                   \
+    uint32_t exp = v >> 23 & 0xff;                                                  \
+    return fclass(v >> 31, exp == 0xff, exp == 0, (v & 0x7fffff) == 0, v >> 22 & 1); \
+}                                                                                   \
+                                                                                    \
+static inline uint64_t f64_classify(uint64_t v) {                                   \
+    uint64_t exp = v >> 52 & 0x7ff;                                                 \
+    return fclass(v >> 63, exp == 0x7ff, exp == 0, (v & 0xfffffffffffffull) == 0,  \
+                  v >> 51 & 1);                                                     \
+}                                                                                   \
+                                                                                    \
+/* x rounded to an integer as rm says, dyn rounds to nearest even. */             \
+static inline double fround(double x, int rm) {                                     \
+    switch (rm) {                                                                   \
+    case 1: return __builtin_trunc(x);                                              \
+    case 2: return __builtin_floor(x);                                              \
+    case 3: return __builtin_ceil(x);                                               \
+    case 4: return __builtin_round(x);                                              \
+    default: return __builtin_nearbyint(x);                                         \
+    }                                                                               \
+}                                                                                   \
+                                                                                    \
+/* conversions to integers saturate, and nan goes to the largest one. */          \
+static inline uint64_t fcvt_w(double x, int rm) {                                   \
+    x = fround(x, rm);                                                              \
+    if (x != x || x >= 2147483647.0) return 0x7fffffff;                             \
+    if (x <= -2147483648.0) return (uint64_t)-0x80000000ll;                         \
+    return (uint64_t)(int64_t)(int32_t)x;                                           \
+}                                                                                   \
+                                                                                    \
+static inline uint64_t fcvt_wu(double x, int rm) {                                  \
+    x = fround(x, rm);                                                              \
+    if (x != x || x >= 4294967295.0) return ~0ull;                                  \
+    if (x <= 0) return 0;                                                           \
+    return (uint64_t)(int64_t)(int32_t)(uint32_t)x;                                 \
+}                                                                                   \
+                                                                                    \
+static inline uint64_t fcvt_l(double x, int rm) {                                   \
+    x = fround(x, rm);                                                              \
+    if (x != x || x >= 9223372036854775808.0) return 0x7fffffffffffffffull;         \
+    if (x <= -9223372036854775808.0) return 0x8000000000000000ull;                  \
+    return (uint64_t)(int64_t)x;                                                    \
+}                                                                                   \
+                                                                                    \
+static inline uint64_t fcvt_lu(double x, int rm) {                                  \
+    x = fround(x, rm);                                                              \
+    if (x != x || x >= 18446744073709551616.0) return ~0ull;                        \
+    if (x <= 0) return 0;                                                           \
+    return (uint64_t)x;                                                             \
+}                                                                                   \
 
-inline int64_t mulh(int64_t a, int64_t b) {
-    int negate = (a < 0) != (b < 0);
-    uint64_t res = mulhu(a < 0 ? -a : a, b < 0 ? -b : b);
-    return negate ? ~res + (a * b == 0) : res;
-}
-
-inline int64_t mulhsu(int64_t a, uint64_t b) {
-    int negate = a < 0;
-    uint64_t res = mulhu(a < 0 ? -a : a, b);
-    return negate ? ~res + (a * b == 0) : res;
-}
-
-#define F32_SIGN ((uint32_t)1 << 31)
-#define F64_SIGN ((uint64_t)1 << 63)
-
-inline u32 fsgnj32(u32 a, u32 b, bool n, bool x) {
-    u32 v = x ? a : n ? F32_SIGN : 0;
-    return (a & ~F32_SIGN) | ((v ^ b) & F32_SIGN);
-}
-
-inline u64 fsgnj64(u64 a, u64 b, bool n, bool x) {
-    u64 v = x ? a : n ? F64_SIGN : 0;
-    return (a & ~F64_SIGN) | ((v ^ b) & F64_SIGN);
-}
-
-union u32_f32 { u32 ui; f32 f; };
-#define signF32UI(a) ((bool) ((uint32_t) (a)>>31))
-#define expF32UI(a) ((int_fast16_t) ((a)>>23) & 0xFF)
-#define fracF32UI(a) ((a) & 0x007FFFFF)
-#define isNaNF32UI(a) (((~(a) & 0x7F800000) == 0) && ((a) & 0x007FFFFF))
-#define isSigNaNF32UI(uiA) ((((uiA) & 0x7FC00000) == 0x7F800000) && ((uiA) & 0x003FFFFF))
-
-inline u16 f32_classify(f32 a) {
-    union u32_f32 uA;
-    u32 uiA;
-
-    uA.f = a;
-    uiA = uA.ui;
-
-    u16 infOrNaN = expF32UI(uiA) == 0xFF;
-    u16 subnormalOrZero = expF32UI(uiA) == 0;
-    bool sign = signF32UI(uiA);
-    bool fracZero = fracF32UI(uiA) == 0;
-    bool isNaN = isNaNF32UI(uiA);
-    bool isSNaN = isSigNaNF32UI(uiA);
-
-    return
-        (sign && infOrNaN && fracZero)          << 0 |
-        (sign && !infOrNaN && !subnormalOrZero) << 1 |
-        (sign && subnormalOrZero && !fracZero)  << 2 |
-        (sign && subnormalOrZero && fracZero)   << 3 |
-        (!sign && infOrNaN && fracZero)          << 7 |
-        (!sign && !infOrNaN && !subnormalOrZero) << 6 |
-        (!sign && subnormalOrZero && !fracZero)  << 5 |
-        (!sign && subnormalOrZero && fracZero)   << 4 |
-        (isNaN &&  isSNaN)                       << 8 |
-        (isNaN && !isSNaN)                       << 9;
-}
-
-union u64_f64 { u64 ui; f64 f; };
-#define signF64UI(a) ((bool) ((uint64_t) (a)>>63))
-#define expF64UI(a) ((int_fast16_t) ((a)>>52) & 0x7FF)
-#define fracF64UI(a) ((a) & UINT64_C(0x000FFFFFFFFFFFFF))
-#define isNaNF64UI(a) (((~(a) & UINT64_C(0x7FF0000000000000)) == 0) && ((a) & UINT64_C(0x000FFFFFFFFFFFFF)))
-#define isSigNaNF64UI(uiA) ((((uiA) & UINT64_C(0x7FF8000000000000)) == UINT64_C(0x7FF0000000000000)) && ((uiA) & UINT64_C(0x0007FFFFFFFFFFFF)))
-
-inline u16 f64_classify(f64 a) {
-    union u64_f64 uA;
-    u64 uiA;
-
-    uA.f = a;
-    uiA = uA.ui;
-
-    u16 infOrNaN = expF64UI(uiA) == 0x7FF;
-    u16 subnormalOrZero = expF64UI(uiA) == 0;
-    bool sign = signF64UI(uiA);
-    bool fracZero = fracF64UI(uiA) == 0;
-    bool isNaN = isNaNF64UI(uiA);
-    bool isSNaN = isSigNaNF64UI(uiA);
-
-    return
-        (sign && infOrNaN && fracZero)          << 0 |
-        (sign && !infOrNaN && !subnormalOrZero) << 1 |
-        (sign && subnormalOrZero && !fracZero)  << 2 |
-        (sign && subnormalOrZero && fracZero)   << 3 |
-        (!sign && infOrNaN && fracZero)          << 7 |
-        (!sign && !infOrNaN && !subnormalOrZero) << 6 |
-        (!sign && subnormalOrZero && !fracZero)  << 5 |
-        (!sign && subnormalOrZero && fracZero)   << 4 |
-        (isNaN &&  isSNaN)                       << 8 |
-        (isNaN && !isSNaN)                       << 9;
-}
+INTERP_HELPERS
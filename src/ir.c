@@ -0,0 +1,315 @@
+#include "rvemu.h"
+
+/**
+ * the region of a translation as a graph of decoded instructions, between
+ * the decoder and the C that machine_genblock() prints from it. a few
+ * passes go over it before anything is printed:
+ *
+ * - constants: lui and auipc chains, and what is computed from them with
+ *   immediates, are folded into the value they make. a jalr whose target
+ *   is such a constant goes on to it within the region, guarded, as a jal.
+ * - dead writes: a register that is written again before anything reads
+ *   it, or the code can go anywhere else, is not computed the first time.
+ *
+ * both only look along straight-line code: from an instruction on to the
+ * one it falls through or jumps to, when nothing else in the region goes
+ * there. clang would find most of it too, but only after parsing it all.
+ */
+
+#define IR_INDEX_SIZE 1024 // pcs at first, doubled as it fills
+#define IR_DEAD_SCAN  64   // instructions looked ahead for a second write
+
+/**
+ * an indirect jump is followed into the target tier 1 saw it take once
+ * that target leads the others by TRACE_MIN_LEAD jumps, and only while
+ * the region has fewer than TRACE_MAX_INSNS instructions.
+ */
+#define TRACE_MIN_LEAD  100
+#define TRACE_MAX_INSNS 2048
+
+static void ir_index_init(ir_region_t *r, u64 cap) {
+    r->pcs = (u64 *)calloc(cap, sizeof(u64));
+    r->slots = (u32 *)calloc(cap, sizeof(u32));
+    r->mask = cap - 1;
+}
+
+static inline u64 ir_probe(ir_region_t *r, u64 pc) {
+    u64 index = (pc * 0x9e3779b97f4a7c15ULL) & r->mask;
+    while (r->pcs[index] != pc && r->pcs[index] != 0)
+        index = (index + 1) & r->mask;
+    return index;
+}
+
+ir_node_t *ir_node(ir_region_t *r, u64 pc) {
+    u64 index = ir_probe(r, pc);
+    return r->pcs[index] == pc ? &r->nodes[r->slots[index]] : NULL;
+}
+
+static ir_node_t *ir_add(ir_region_t *r, u64 pc) {
+    if (2 * (r->len + 1) > r->mask + 1) {
+        u64 *pcs = r->pcs, cap = r->mask + 1;
+        u32 *slots = r->slots;
+        ir_index_init(r, cap * 2);
+        for (u64 i = 0; i < cap; i++) {
+            if (pcs[i] == 0) continue;
+            u64 j = ir_probe(r, pcs[i]);
+            r->pcs[j] = pcs[i];
+            r->slots[j] = slots[i];
+        }
+        free(pcs);
+        free(slots);
+    }
+    if (r->len == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 256;
+        r->nodes = (ir_node_t *)realloc(r->nodes, r->cap * sizeof(ir_node_t));
+    }
+
+    u64 index = ir_probe(r, pc);
+    r->pcs[index] = pc;
+    r->slots[index] = r->len;
+    ir_node_t *node = &r->nodes[r->len++];
+    *node = (ir_node_t){ .pc = pc };
+    return node;
+}
+
+static void ir_reset(ir_region_t *r) {
+    if (r->pcs == NULL) ir_index_init(r, IR_INDEX_SIZE);
+    memset(r->pcs, 0, (r->mask + 1) * sizeof(u64));
+    r->len = 0;
+}
+
+// whether insn writes rd, a general purpose register.
+bool ir_writes_gp(insn_t *insn) {
+    switch (insn->type) {
+    case insn_lb ... insn_lwu:
+    case insn_addi ... insn_sraiw:
+    case insn_add ... insn_sraw:
+    case insn_jalr: case insn_jal:
+    case insn_csrrc ... insn_csrrwi:
+    case insn_fcvt_w_s: case insn_fcvt_wu_s: case insn_fmv_x_w:
+    case insn_feq_s: case insn_flt_s: case insn_fle_s: case insn_fclass_s:
+    case insn_fcvt_l_s: case insn_fcvt_lu_s:
+    case insn_feq_d: case insn_flt_d: case insn_fle_d: case insn_fclass_d:
+    case insn_fcvt_w_d: case insn_fcvt_wu_d: case insn_fcvt_l_d: case insn_fcvt_lu_d:
+    case insn_fmv_x_d:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// whether insn does nothing but compute rd from registers and immediates.
+static bool ir_pure(insn_t *insn) {
+    return ((insn->type >= insn_addi && insn->type <= insn_sraiw) ||
+            (insn->type >= insn_add && insn->type <= insn_sraw)) && insn->rd != zero;
+}
+
+// may insn read reg? register fields of floating point operands count too.
+static bool ir_reads(insn_t *insn, i8 reg) {
+    return insn->rs1 == reg || insn->rs2 == reg || insn->rs3 == reg;
+}
+
+// whether insn may leave for a pc other than the one ir_follower() gives.
+static inline bool ir_branch(insn_t *insn) {
+    return (insn->type >= insn_beq && insn->type <= insn_bgeu) || insn->type == insn_jalr;
+}
+
+static inline u64 ir_next_pc(ir_node_t *node) {
+    return node->pc + (node->insn.rvc ? 2 : 4);
+}
+
+/**
+ * the value insn leaves in rd, if known[] and values[] make it a constant.
+ * x0 is always known.
+ */
+static bool ir_eval(insn_t *insn, u64 pc, bool *known, u64 *values, u64 *val) {
+    u64 rs1 = values[insn->rs1], rs2 = values[insn->rs2];
+    i64 imm = insn->imm;
+    bool k1 = known[insn->rs1], k2 = known[insn->rs2];
+
+    switch (insn->type) {
+    case insn_lui:   *val = imm; return true;
+    case insn_auipc: *val = pc + imm; return true;
+    case insn_jal:
+    case insn_jalr:  *val = pc + (insn->rvc ? 2 : 4); return true;
+    case insn_addi:  *val = rs1 + imm; return k1;
+    case insn_addiw: *val = (i64)(i32)(rs1 + imm); return k1;
+    case insn_xori:  *val = rs1 ^ imm; return k1;
+    case insn_ori:   *val = rs1 | imm; return k1;
+    case insn_andi:  *val = rs1 & imm; return k1;
+    case insn_slli:  *val = rs1 << (imm & 0x3f); return k1;
+    case insn_srli:  *val = rs1 >> (imm & 0x3f); return k1;
+    case insn_srai:  *val = (i64)rs1 >> (imm & 0x3f); return k1;
+    case insn_slliw: *val = (i64)(i32)(rs1 << (imm & 0x1f)); return k1;
+    case insn_add:   *val = rs1 + rs2; return k1 && k2;
+    case insn_sub:   *val = rs1 - rs2; return k1 && k2;
+    case insn_addw:  *val = (i64)(i32)(rs1 + rs2); return k1 && k2;
+    default:         return false;
+    }
+}
+
+// what insn makes of known[] and values[].
+static void ir_step(ir_node_t *node, bool *known, u64 *values) {
+    insn_t *insn = &node->insn;
+    if (!ir_writes_gp(insn) || insn->rd == zero) return;
+
+    u64 val = 0;
+    known[insn->rd] = ir_eval(insn, node->pc, known, values, &val);
+    values[insn->rd] = val;
+    known[zero] = true;
+    values[zero] = 0;
+}
+
+/**
+ * walks the code from the entry of the region, depth first, as far as
+ * branches, calls and the jumps of opts go, and at most opts->max_insns
+ * instructions. every pc the walk reaches past that is an exit.
+ */
+void ir_build(machine_t *m, genopts_t *opts, ir_region_t *r) {
+    ir_reset(r);
+
+    static pcstack_t stack;
+    stack_reset(&stack);
+    stack_push(&stack, m->state.pc);
+
+    // constants along the code walked last, for targets of jalrs.
+    bool known[num_gp_regs] = { [zero] = true };
+    u64 values[num_gp_regs] = {0};
+    u64 follows = 0;
+
+    u64 pc;
+    r->ninsns = 0;
+    while (stack_pop(&stack, &pc)) {
+        if (ir_node(r, pc) != NULL) continue;
+        ir_node_t *node = ir_add(r, pc);
+
+        // the region is full, whatever it still branches to is left to the dispatcher.
+        if (opts->max_insns != 0 && r->ninsns >= opts->max_insns) {
+            node->exit = true;
+            continue;
+        }
+        r->ninsns++;
+
+        insn_t *insn = &node->insn;
+        insn_decode(insn, *(u32 *)TO_HOST(pc));
+        smc_watch(m, m->state.pc, pc, insn->rvc ? 2 : 4);
+        if (insn->type == insn_fence_i) insn->cont = true;
+
+        if (pc != follows) {
+            memset(known, 0, sizeof(known));
+            known[zero] = true;
+        }
+
+        u64 trace, lead;
+        switch (insn->type) {
+        case insn_beq ... insn_bgeu:
+            node->target = pc + (i64)insn->imm;
+            break;
+        case insn_jal:
+            if (!(opts->flags & GEN_SPLIT_CALLS) || insn->rd == zero)
+                node->target = pc + (i64)insn->imm;
+            break;
+        case insn_jalr:
+            if ((opts->flags & GEN_SPLIT_CALLS) && insn->rd != zero)
+                break;
+            if (known[insn->rs1])
+                node->target = (values[insn->rs1] + (i64)insn->imm) & ~(u64)1;
+            else if ((opts->flags & GEN_TRACES) && r->ninsns < TRACE_MAX_INSNS &&
+                     profile_target(opts->profile, pc, &trace, &lead) && lead >= TRACE_MIN_LEAD)
+                node->target = trace;
+            break;
+        default:
+            break;
+        }
+        ir_step(node, known, values);
+
+        if (node->target != 0) stack_push(&stack, node->target);
+        if (!insn->cont) stack_push(&stack, ir_next_pc(node));
+        follows = insn->cont ? node->target : ir_next_pc(node);
+    }
+}
+
+/**
+ * the instruction that runs right after node and has no other way in,
+ * so what is known after node still holds there. NULL if there is none.
+ */
+static ir_node_t *ir_follower(ir_region_t *r, ir_node_t *node) {
+    if (node->exit) return NULL;
+    u64 pc = node->insn.cont ? node->target : ir_next_pc(node);
+    if (pc == 0) return NULL;
+    ir_node_t *next = ir_node(r, pc);
+    if (next == NULL || next->exit || next->preds != 1) return NULL;
+    return next;
+}
+
+static void ir_count_preds(ir_region_t *r) {
+    for (u64 i = 0; i < r->len; i++) r->nodes[i].preds = 0;
+    r->nodes[0].preds = 1; // the entry
+
+    for (u64 i = 0; i < r->len; i++) {
+        ir_node_t *node = &r->nodes[i];
+        if (node->exit) continue;
+        if (node->target != 0) ir_node(r, node->target)->preds++;
+        if (!node->insn.cont) ir_node(r, ir_next_pc(node))->preds++;
+    }
+}
+
+/**
+ * follows each run of straight-line code from its head, the instruction
+ * that has more than one way in, or whose only one is a branch taken.
+ */
+static void ir_fold_constants(ir_region_t *r) {
+    for (u64 i = 0; i < r->len; i++) r->nodes[i].chained = false;
+    for (u64 i = 0; i < r->len; i++) {
+        ir_node_t *next = ir_follower(r, &r->nodes[i]);
+        if (next != NULL) next->chained = true;
+    }
+
+    bool known[num_gp_regs];
+    u64 values[num_gp_regs];
+    for (u64 i = 0; i < r->len; i++) {
+        ir_node_t *node = &r->nodes[i];
+        if (node->exit || node->chained) continue;
+
+        memset(known, 0, sizeof(known));
+        memset(values, 0, sizeof(values));
+        known[zero] = true;
+        for (u64 n = 0; node != NULL && n < r->len; n++) {
+            u64 val = 0;
+            node->known = ir_pure(&node->insn) &&
+                          ir_eval(&node->insn, node->pc, known, values, &val);
+            node->value = val;
+            ir_step(node, known, values);
+            node = ir_follower(r, node);
+        }
+    }
+}
+
+// whether the value node leaves in rd is written over before it is read.
+static bool ir_overwritten(ir_region_t *r, ir_node_t *node) {
+    i8 rd = node->insn.rd;
+    ir_node_t *next = node;
+    for (int n = 0; n < IR_DEAD_SCAN; n++) {
+        // a branch may go where rd is read.
+        if (ir_branch(&next->insn)) return false;
+        next = ir_follower(r, next);
+        if (next == NULL) return false;
+        // a folded instruction reads nothing, it only sets rd.
+        if (!next->known && ir_reads(&next->insn, rd)) return false;
+        if (ir_writes_gp(&next->insn) && next->insn.rd == rd) return true;
+    }
+    return false;
+}
+
+static void ir_drop_dead(ir_region_t *r) {
+    for (u64 i = 0; i < r->len; i++) {
+        ir_node_t *node = &r->nodes[i];
+        node->dead = !node->exit && ir_pure(&node->insn) && ir_overwritten(r, node);
+    }
+}
+
+void ir_optimize(ir_region_t *r) {
+    ir_count_preds(r);
+    ir_fold_constants(r);
+    ir_drop_dead(r);
+}
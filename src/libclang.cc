@@ -0,0 +1,125 @@
+/**
+ * in-process compilation backend, built with `make LIBCLANG=1`.
+ *
+ * instead of spawning the clang driver for every block, the generated source
+ * is compiled by a clang CompilerInstance living inside rvemu. each compiler
+ * thread keeps its own instance: the parsed invocation and the diagnostics
+ * engine are set up once and reused for every block, the per-file state
+ * (file and source managers) is dropped in between, and every unit gets an
+ * LLVM context of its own, as the types and constants one interns are never
+ * freed before the context is.
+ */
+#include <clang/Basic/Diagnostic.h>
+#include <clang/Basic/DiagnosticOptions.h>
+#include <clang/Basic/Version.h>
+#include <clang/CodeGen/CodeGenAction.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/CompilerInvocation.h>
+#include <clang/Frontend/TextDiagnosticPrinter.h>
+#include <clang/Lex/PreprocessorOptions.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/IR/LLVMContext.h>
+#if LLVM_VERSION_MAJOR >= 17
+#include <llvm/TargetParser/Host.h>
+#else
+#include <llvm/Support/Host.h>
+#endif
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define INPUT_NAME "rvemu-jit.c"
+
+namespace {
+
+struct compiler_t {
+    clang::CompilerInstance ci;
+    std::shared_ptr<clang::CompilerInvocation> invocation;
+    llvm::SmallVector<char, 0> out;
+};
+
+// the code generation options the driver picks for `clang -O<n> -c` on a
+// PIE-by-default host, so both backends produce the same kind of object:
+// the optimization level, pie, and from -O2 on the loop and slp vectorizers,
+// which the driver turns on by flags of their own rather than by the level.
+compiler_t *new_compiler(int opt_level) {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+        llvm::InitializeNativeTargetAsmParser();
+    });
+
+    compiler_t *c = new compiler_t();
+    c->ci.createDiagnostics(new clang::TextDiagnosticPrinter(
+        llvm::errs(), new clang::DiagnosticOptions()));
+
+    std::string triple = llvm::sys::getProcessTriple();
+    std::string opt = "-O" + std::to_string(opt_level);
+    std::vector<const char *> args = {
+        "-triple", triple.c_str(),
+        "-emit-obj",
+        opt.c_str(),
+        "-mrelocation-model", "pic", "-pic-level", "2", "-pic-is-pie",
+    };
+    if (opt_level >= 2) {
+        args.push_back("-vectorize-loops");
+        args.push_back("-vectorize-slp");
+    }
+    args.insert(args.end(), { "-x", "c", INPUT_NAME });
+
+    c->invocation = std::make_shared<clang::CompilerInvocation>();
+    if (!clang::CompilerInvocation::CreateFromArgs(*c->invocation, args,
+                                                   c->ci.getDiagnostics())) {
+        delete c;
+        return nullptr;
+    }
+    return c;
+}
+
+} // namespace
+
+extern "C" const char *libclang_version() {
+    static std::string version = clang::getClangFullVersion();
+    return version.c_str();
+}
+
+extern "C" unsigned char *libclang_compile(const char *source, size_t len, int opt_level, size_t *sz) {
+    // one instance per optimization level, each tier keeps its own settings.
+    thread_local compiler_t *compilers[4];
+    assert(opt_level >= 0 && opt_level < 4);
+    if (compilers[opt_level] == nullptr) compilers[opt_level] = new_compiler(opt_level);
+    compiler_t *c = compilers[opt_level];
+    if (c == nullptr) return nullptr;
+
+    auto invocation = std::make_shared<clang::CompilerInvocation>(*c->invocation);
+    invocation->getPreprocessorOpts().addRemappedFile(
+        INPUT_NAME,
+        llvm::MemoryBuffer::getMemBufferCopy(llvm::StringRef(source, len), INPUT_NAME).release());
+
+    c->ci.setInvocation(invocation);
+    c->ci.setSourceManager(nullptr);
+    c->ci.setFileManager(nullptr);
+
+    c->out.clear();
+    c->ci.setOutputStream(std::make_unique<llvm::raw_svector_ostream>(c->out));
+
+    // the action owns the module, so it goes before the context it lives in.
+    llvm::LLVMContext context;
+    clang::EmitObjAction action(&context);
+    if (!c->ci.ExecuteAction(action) || c->out.empty()) return nullptr;
+
+    unsigned char *buf = (unsigned char *)malloc(c->out.size());
+    memcpy(buf, c->out.data(), c->out.size());
+    *sz = c->out.size();
+    return buf;
+}
@@ -0,0 +1,316 @@
+#include "rvemu.h"
+
+/**
+ * the linker for the objects clang produces. every allocatable section is
+ * copied into the code cache, symbols the object does not define are taken
+ * from a table of host helpers, and relocations are applied against where
+ * everything landed.
+ *
+ * the code cache can be anywhere in the address space, far from the host
+ * helpers, so calls and got loads of a symbol go through a slot placed in
+ * the cache next to the unit: the symbol's address, usable as a got entry,
+ * followed by an indirect jump through it, usable as a plt stub.
+ */
+
+typedef struct {
+    const char *name;
+    void *addr;
+} helper_t;
+
+static const helper_t helpers[] = {
+    {"memcpy",    (void *)memcpy},
+    {"memmove",   (void *)memmove},
+    {"memset",    (void *)memset},
+    {"memcmp",    (void *)memcmp},
+    {"sqrt",      (void *)sqrt},
+    {"sqrtf",     (void *)sqrtf},
+    {"fma",       (void *)fma},
+    {"fmaf",      (void *)fmaf},
+    {"fmin",      (void *)fmin},
+    {"fminf",     (void *)fminf},
+    {"fmax",      (void *)fmax},
+    {"fmaxf",     (void *)fmaxf},
+    {"rint",      (void *)rint},
+    {"rintf",     (void *)rintf},
+    {"nearbyint", (void *)nearbyint},
+    {"nearbyintf",(void *)nearbyintf},
+    {"llrint",    (void *)llrint},
+    {"llrintf",   (void *)llrintf},
+    {"trunc",     (void *)trunc},
+    {"truncf",    (void *)truncf},
+    {"floor",     (void *)floor},
+    {"floorf",    (void *)floorf},
+    {"ceil",      (void *)ceil},
+    {"ceilf",     (void *)ceilf},
+    {"round",     (void *)round},
+    {"roundf",    (void *)roundf},
+};
+
+typedef struct {
+    u64 addr;
+    u8 jmp[6];
+    u8 pad[2];
+} slot_t;
+
+// jmp *-14(%rip), which is the addr field of the same slot.
+static const u8 slot_jmp[6] = { 0xff, 0x25, 0xf2, 0xff, 0xff, 0xff };
+
+static void *helper_lookup(const char *name) {
+    for (u64 i = 0; i < ARRAY_SIZE(helpers); i++) {
+        if (strcmp(helpers[i].name, name) == 0) return helpers[i].addr;
+    }
+    return NULL;
+}
+
+typedef struct {
+    machine_t *m;
+    u8 *elfbuf;
+    elf64_ehdr_t *ehdr;
+    elf64_shdr_t *shdrs;
+    u8 **addrs;
+    elf64_sym_t *syms;
+    char *strtab;
+    u64 nrelocs;
+} object_view_t;
+
+static u64 symbol_address(object_view_t *o, u64 idx) {
+    elf64_sym_t *sym = &o->syms[idx];
+    if (sym->st_shndx == SHN_UNDEF) {
+        // the branch counters of tier 1 code, see GEN_PROFILE, the chain
+        // slots of exits, the inline caches of jalrs and the dispatcher.
+        // they are in the code cache, where the code can reach them
+        // pc-relative.
+        char *name = o->strtab + sym->st_name;
+        u64 pc;
+        int len = 0;
+        if (sscanf(name, PROFILE_SYMBOL "%n", &pc, &len) == 1 && name[len] == '\0') {
+            profile_t *p = cache_profile(o->m->cache, pc);
+            // the guest code may have changed since the counters were made.
+            if (p->counts == NULL || p->ncounts < p->nbranches) {
+                p->counts = (u64 *)cache_alloc(o->m->cache, 2 * p->nbranches * sizeof(u64), 8);
+                p->ncounts = p->nbranches;
+            }
+            return (u64)p->counts;
+        }
+        if (sscanf(name, CHAIN_SYMBOL "%n", &pc, &len) == 1 && name[len] == '\0')
+            return (u64)cache_chain(o->m->cache, pc);
+        if (sscanf(name, IC_SYMBOL "%n", &pc, &len) == 1 && name[len] == '\0')
+            return (u64)cache_ic(o->m->cache, pc);
+        if (strcmp(name, DISPATCH_SYMBOL) == 0)
+            return (u64)o->m->cache->dispatch;
+
+        void *addr = helper_lookup(name);
+        if (addr == NULL) fatalf("undefined symbol %s", name);
+        return (u64)addr;
+    }
+    if (sym->st_shndx == SHN_ABS) return sym->st_value;
+
+    assert(sym->st_shndx < o->ehdr->e_shnum && o->addrs[sym->st_shndx] != NULL);
+    return (u64)o->addrs[sym->st_shndx] + sym->st_value;
+}
+
+static bool needs_slot(object_view_t *o, elf64_rela_t *rel) {
+    switch (rel->r_type) {
+    case R_X86_64_GOTPCREL:
+    case R_X86_64_GOTPCRELX:
+    case R_X86_64_REX_GOTPCRELX:
+        return true;
+    case R_X86_64_PLT32:
+        return o->syms[rel->r_sym].st_shndx == SHN_UNDEF;
+    default:
+        return false;
+    }
+}
+
+static void write_pc32(u8 *loc, i64 val) {
+    if (val != (i32)val) fatal("relocation out of range");
+    *(u32 *)loc = (u32)val;
+}
+
+static void apply_rela(object_view_t *o, elf64_shdr_t *shdr, slot_t *slots, i64 *slot_idx) {
+    u8 *base = o->addrs[shdr->sh_info];
+    i64 rels = shdr->sh_size / sizeof(elf64_rela_t);
+
+    for (i64 i = 0; i < rels; i++) {
+        elf64_rela_t *rel = (elf64_rela_t *)(o->elfbuf + shdr->sh_offset) + i;
+        if (rel->r_type == R_X86_64_NONE) continue;
+
+        // the code is patched through the writable view of the cache.
+        i64 p = (i64)(base + rel->r_offset);
+        u8 *loc = cache_writable(o->m->cache, base + rel->r_offset);
+        i64 a = rel->r_addend;
+        slot_t *slot = slot_idx[rel->r_sym] >= 0 ? &slots[slot_idx[rel->r_sym]] : NULL;
+
+        switch (rel->r_type) {
+        case R_X86_64_64:
+            *(u64 *)loc = symbol_address(o, rel->r_sym) + a;
+            break;
+        case R_X86_64_PC64:
+            *(u64 *)loc = symbol_address(o, rel->r_sym) + a - p;
+            break;
+        case R_X86_64_32: {
+            u64 val = symbol_address(o, rel->r_sym) + a;
+            if (val != (u32)val) fatal("relocation out of range");
+            *(u32 *)loc = (u32)val;
+            break;
+        }
+        case R_X86_64_32S: {
+            i64 val = symbol_address(o, rel->r_sym) + a;
+            if (val != (i32)val) fatal("relocation out of range");
+            *(u32 *)loc = (u32)val;
+            break;
+        }
+        case R_X86_64_PC32:
+            write_pc32(loc, (i64)symbol_address(o, rel->r_sym) + a - p);
+            break;
+        case R_X86_64_PLT32:
+            if (slot) write_pc32(loc, (i64)slot->jmp + a - p);
+            else write_pc32(loc, (i64)symbol_address(o, rel->r_sym) + a - p);
+            break;
+        case R_X86_64_GOTPCREL:
+        case R_X86_64_GOTPCRELX:
+        case R_X86_64_REX_GOTPCRELX:
+            write_pc32(loc, (i64)&slot->addr + a - p);
+            break;
+        default:
+            fatalf("unsupported relocation type %u", rel->r_type);
+        }
+        o->nrelocs++;
+    }
+}
+
+/**
+ * places the unit into the code cache and installs its blocks. false if the
+ * cache was flushed on the way, which dropped whatever was placed before.
+ */
+static bool link_unit(machine_t *m, compile_unit_t *unit) {
+    u64 generation = m->cache->generation, offset = m->cache->offset;
+    bool empty = cache_empty(m->cache);
+    object_view_t o = { .m = m, .elfbuf = unit->obj.buf };
+    o.ehdr = (elf64_ehdr_t *)o.elfbuf;
+    o.shdrs = (elf64_shdr_t *)(o.elfbuf + o.ehdr->e_shoff);
+    assert(o.ehdr->e_shnum != 0);
+
+    char *shstrtab = (char *)(o.elfbuf + o.shdrs[o.ehdr->e_shstrndx].sh_offset);
+    o.addrs = (u8 **)calloc(o.ehdr->e_shnum, sizeof(u8 *));
+    elf64_shdr_t *symtab = NULL;
+
+    for (i64 idx = 0; idx < o.ehdr->e_shnum; idx++) {
+        elf64_shdr_t *shdr = &o.shdrs[idx];
+        if (shdr->sh_type == SHT_SYMTAB) symtab = shdr;
+        if (!(shdr->sh_flags & SHF_ALLOC) || shdr->sh_size == 0) continue;
+
+        if (shdr->sh_type == SHT_NOBITS) {
+            o.addrs[idx] = cache_alloc(m->cache, shdr->sh_size, shdr->sh_addralign);
+            continue;
+        }
+
+        // unwind tables are of no use to us, the block functions never throw.
+        if (shdr->sh_type != SHT_PROGBITS || strcmp(shstrtab + shdr->sh_name, ".eh_frame") == 0)
+            continue;
+
+        // data the code writes goes with the rest of its data.
+        if (shdr->sh_flags & SHF_WRITE) {
+            o.addrs[idx] = cache_alloc(m->cache, shdr->sh_size, shdr->sh_addralign);
+            memcpy(o.addrs[idx], o.elfbuf + shdr->sh_offset, shdr->sh_size);
+            continue;
+        }
+
+        o.addrs[idx] = cache_copy(m->cache, o.elfbuf + shdr->sh_offset,
+                                  shdr->sh_size, shdr->sh_addralign);
+    }
+
+    assert(symtab != NULL);
+    o.syms = (elf64_sym_t *)(o.elfbuf + symtab->sh_offset);
+    o.strtab = (char *)(o.elfbuf + o.shdrs[symtab->sh_link].sh_offset);
+    i64 nsyms = symtab->sh_size / sizeof(elf64_sym_t);
+
+    // one slot per symbol that is called through the plt or loaded from the got.
+    i64 *slot_idx = (i64 *)malloc(nsyms * sizeof(i64));
+    memset(slot_idx, 0xff, nsyms * sizeof(i64));
+    i64 nslots = 0;
+    for (i64 idx = 0; idx < o.ehdr->e_shnum; idx++) {
+        elf64_shdr_t *shdr = &o.shdrs[idx];
+        if (shdr->sh_type != SHT_RELA || o.addrs[shdr->sh_info] == NULL) continue;
+
+        i64 rels = shdr->sh_size / sizeof(elf64_rela_t);
+        for (i64 i = 0; i < rels; i++) {
+            elf64_rela_t *rel = (elf64_rela_t *)(o.elfbuf + shdr->sh_offset) + i;
+            if (needs_slot(&o, rel) && slot_idx[rel->r_sym] < 0)
+                slot_idx[rel->r_sym] = nslots++;
+        }
+    }
+
+    slot_t *slots = NULL;
+    if (nslots > 0) {
+        slot_t *buf = (slot_t *)calloc(nslots, sizeof(slot_t));
+        for (i64 i = 0; i < nsyms; i++) {
+            if (slot_idx[i] < 0) continue;
+            buf[slot_idx[i]].addr = symbol_address(&o, i);
+            memcpy(buf[slot_idx[i]].jmp, slot_jmp, sizeof(slot_jmp));
+        }
+        slots = (slot_t *)cache_copy(m->cache, (u8 *)buf, nslots * sizeof(slot_t), sizeof(slot_t));
+        free(buf);
+    }
+
+    for (i64 idx = 0; idx < o.ehdr->e_shnum; idx++) {
+        elf64_shdr_t *shdr = &o.shdrs[idx];
+        if (shdr->sh_type != SHT_RELA || o.addrs[shdr->sh_info] == NULL) continue;
+        apply_rela(&o, shdr, slots, slot_idx);
+    }
+
+    // placing the sections, their slots or the data the relocations refer
+    // to may have flushed the cache, nothing of the unit can be installed.
+    if (m->cache->generation != generation) {
+        free(slot_idx);
+        free(o.addrs);
+        if (empty) fatal("a translation unit does not fit in the code cache");
+        // what was placed after the flush is of no use either.
+        cache_flush(m->cache);
+        return false;
+    }
+
+    u64 njobs = 0, installed = 0;
+    for (compile_job_t *job = unit->jobs; job != NULL; job = job->next) njobs++;
+
+    for (i64 i = 0; i < nsyms; i++) {
+        elf64_sym_t *sym = &o.syms[i];
+        char *name = o.strtab + sym->st_name;
+        u64 pc;
+        int len = 0;
+        if (sscanf(name, BLOCK_SYMBOL "%n", &pc, &len) != 1 || name[len] != '\0')
+            continue;
+
+        // objects from the disk cache may hold blocks besides the jobs', those
+        // were never checked against the guest code. a unit without jobs is
+        // trusted as a whole, see aot_load().
+        compile_job_t *job = unit->jobs;
+        while (job != NULL && job->pc != pc) job = job->next;
+        if (job == NULL && unit->jobs != NULL) continue;
+        // the guest code of the job was written while it was compiled.
+        if (job != NULL && job->epoch != cache_epoch(m->cache, pc)) {
+            installed++;
+            continue;
+        }
+
+        cache_insert(m->cache, pc, (u8 *)symbol_address(&o, i), job ? job->tier : tier_opt);
+        installed++;
+    }
+
+    free(slot_idx);
+    free(o.addrs);
+    assert(unit->jobs == NULL || installed == njobs);
+    stats_record(stat_relocations, o.nrelocs);
+    stats_record(stat_code_bytes, m->cache->offset - offset);
+    return true;
+}
+
+void machine_link(machine_t *m, compile_unit_t *unit) {
+#ifndef __x86_64__
+    fatal("only support x86_64 for now");
+#endif
+    u64 start = stats_now();
+    // the second time the unit goes into an empty cache.
+    while (!link_unit(m, unit));
+    stats_record(stat_link_ns, stats_now() - start);
+}
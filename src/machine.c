@@ -1,31 +1,111 @@
 #include "rvemu.h"
 
+/**
+ * finished compile jobs are only linked into the cache here, between two
+ * blocks, where no translated code is running and the cache can be written.
+ */
+static void machine_install(machine_t *m) {
+    compile_unit_t *unit = pool_take(m->pool);
+    while (unit != NULL) {
+        compile_unit_t *next = unit->next;
+        machine_link(m, unit);
+        for (compile_job_t *job = unit->jobs; job != NULL; job = job->next)
+            stats_record(stat_install_ns, stats_now() - job->submitted);
+        free_unit(unit);
+        unit = next;
+    }
+}
+
+/**
+ * empties the return stack, see RET_STACK_SIZE, whose slots go with the
+ * cache when it is flushed. no jalr goes to an odd pc.
+ */
+static void machine_clear_rets(machine_t *m) {
+    for (int i = 0; i < RET_STACK_SIZE; i++) m->state.rets[i] = (ret_t){ 1, NULL };
+    m->generation = m->cache->generation;
+}
+
+static genopts_t tier_genopts[] = {
+    [tier_fast] = { .flags = GEN_PROFILE, .max_insns = 64 },
+    [tier_opt]  = { .flags = GEN_HINTS | GEN_TRACES },
+};
+
+/**
+ * without a pool the region is compiled right away. otherwise it is handed
+ * to the compiler threads once per tier, and the guest keeps running what
+ * it has until the translation has been installed. copy-and-patch is fast
+ * enough to always run right away, its code is never compiled again.
+ */
+static u8 *machine_translate(machine_t *m, enum tier_t tier) {
+    if (options.backend == backend_cp) {
+        if (!cache_queue(m->cache, m->state.pc, tier_opt)) return NULL;
+        return cp_translate(m);
+    }
+
+    if (m->pool != NULL && pool_full(m->pool)) return NULL;
+    if (!cache_queue(m->cache, m->state.pc, tier)) return NULL;
+
+    genopts_t opts = tier_genopts[tier];
+    opts.profile = cache_profile(m->cache, m->state.pc);
+    str_t source = machine_genblock(m, &opts);
+
+    if (m->pool == NULL) return machine_compile(m, tier, source);
+    pool_submit(m->pool, m->state.pc, tier, cache_epoch(m->cache, m->state.pc), source);
+    return NULL;
+}
+
 enum exit_reason_t machine_step(machine_t *m) {
     while(true) {
-        bool hot = true;
+        stats_poll();
+        m->state.exit_request = 0;
+        smc_sync(m);
+        if (m->pool != NULL) machine_install(m);
+        // copy-and-patch translates right away, as if its queue were empty.
+        cache_adapt(m->cache, m->pool != NULL ? (i64)pool_depth(m->pool) :
+                              options.backend == backend_cp ? 0 : -1);
 
-        u8 *code = cache_lookup(m->cache, m->state.pc);
-        if (code == NULL) {
-            hot = cache_hot(m->cache, m->state.pc);
-            if (hot) {
-                str_t source = machine_genblock(m);
-                code = machine_compile(m, source);
+        bool hot;
+        u8 *code = cache_enter(m->cache, m->state.pc, &hot);
+        if (m->cache->promote != 0) {
+            assert(m->cache->promote == m->state.pc);
+            m->cache->promote = 0;
+            // the translation may have flushed the cache, and code with it.
+            u8 *opt = machine_translate(m, tier_opt);
+            if (opt != NULL) {
+                code = opt;
+            } else {
+                // with the pool full the lookup counts the entry again and
+                // may ask for the promotion once more; the next entry will.
+                code = cache_lookup(m->cache, m->state.pc);
+                m->cache->promote = 0;
             }
+        } else if (hot) {
+            code = machine_translate(m, tier_fast);
         }
 
-        if (!hot) {
+        if (code == NULL) {
             code = (u8 *)exec_block_interp;
         }
+        if (m->generation != m->cache->generation) machine_clear_rets(m);
 
         while (true) {
             m->state.exit_reason = none;
-            ((exec_block_func_t)code)(&m->state);
+            if (options.verify && code != (u8 *)exec_block_interp) verify_run(m, code);
+            else ((exec_block_func_t)code)(&m->state);
             assert(m->state.exit_reason != none);
 
+            if (m->state.ic != NULL) {
+                cache_ic_fill(m->cache, m->state.ic, m->state.reenter_pc);
+                m->state.ic = NULL;
+            }
+
             if (m->state.exit_reason == indirect_branch ||
                 m->state.exit_reason == direct_branch ) {
                 code = cache_lookup(m->cache, m->state.reenter_pc);
-                if (code != NULL) continue;
+                if (code != NULL && m->cache->promote == 0 && !m->state.exit_request) {
+                    m->state.pc = m->state.reenter_pc;
+                    continue;
+                }
             }
 
             if (m->state.exit_reason == interp) {
@@ -41,6 +121,7 @@ enum exit_reason_t machine_step(machine_t *m) {
         switch (m->state.exit_reason) {
         case direct_branch:
         case indirect_branch:
+        case fence_i:
             // continue execution
             break;
         case ecall:
@@ -83,4 +164,6 @@ void machine_setup(machine_t *m, int argc, char *argv[]) {
 
     m->state.gp_regs[sp] -= 8; // argc
     mmu_write(m->state.gp_regs[sp], (u8 *)&args, sizeof(u64));
+
+    machine_clear_rets(m);
 }
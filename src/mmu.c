@@ -36,6 +36,13 @@ static void mmu_load_segment(mmu_t *mmu, elf64_phdr_t *phdr, int fd) {
     }
     mmu->host_alloc = MAX(mmu->host_alloc, (aligned_vaddr + ROUNDUP(memsz, page_size)));
 
+    if (phdr->p_flags & PF_W) {
+        if (mmu->nwritable == MMU_MAX_WRITABLE) fatal("too many writable segments");
+        mmu->writable[mmu->nwritable].start = TO_GUEST(aligned_vaddr);
+        mmu->writable[mmu->nwritable].end = TO_GUEST(aligned_vaddr + ROUNDUP(memsz, page_size));
+        mmu->nwritable++;
+    }
+
     mmu->base = mmu->alloc = TO_GUEST(mmu->host_alloc);
 }
 
@@ -88,3 +95,12 @@ u64 mmu_alloc(mmu_t *mmu, i64 sz) {
 
     return base;
 }
+
+// whether the guest may store to addr, see smc.c.
+bool mmu_writable(mmu_t *mmu, u64 addr) {
+    if (addr >= mmu->base && addr < TO_GUEST(mmu->host_alloc)) return true;
+    for (int i = 0; i < mmu->nwritable; i++) {
+        if (addr >= mmu->writable[i].start && addr < mmu->writable[i].end) return true;
+    }
+    return false;
+}
@@ -0,0 +1,120 @@
+#include "rvemu.h"
+
+// whether the jobs from first to last hold one for pc.
+static bool batch_has(compile_job_t *first, compile_job_t *last, u64 pc) {
+    for (compile_job_t *job = first; job != last->next; job = job->next)
+        if (job->pc == pc) return true;
+    return false;
+}
+
+static void *pool_worker(void *arg) {
+    pool_t *pool = (pool_t *)arg;
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->pending == NULL)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+
+        // whatever queued up for the same tier while the threads were busy
+        // is compiled together. a pc queued again after its code was
+        // dropped, see smc.c, waits for the next unit.
+        compile_job_t *jobs = pool->pending, *last = jobs;
+        u64 njobs = 1;
+        while (last->next != NULL && last->next->tier == jobs->tier &&
+               njobs < COMPILE_BATCH_MAX && !batch_has(jobs, last, last->next->pc)) {
+            last = last->next;
+            njobs++;
+        }
+        pool->pending = last->next;
+        if (pool->pending == NULL) pool->pending_tail = NULL;
+        last->next = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        compile_unit_t *units = compile_jobs(jobs);
+        compile_unit_t *tail = units;
+        u64 nunits = 1;
+        while (tail->next != NULL) {
+            tail = tail->next;
+            nunits++;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        tail->next = pool->done;
+        pool->done = units;
+        pool->inflight -= njobs;
+        __atomic_store_n(&pool->ndone, pool->ndone + nunits, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&pool->lock);
+        __atomic_store_n(pool->exit_request, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+/**
+ * finished units raise exit_request, so a guest running in chained code
+ * comes back to install them.
+ */
+pool_t *new_pool(int nthreads, u32 *exit_request) {
+    assert(nthreads > 0);
+
+    pool_t *pool = (pool_t *)calloc(1, sizeof(pool_t));
+    pool->exit_request = exit_request;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->nthreads = nthreads;
+    pool->threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0)
+            fatal("cannot create compiler thread");
+    }
+
+    return pool;
+}
+
+/**
+ * only the guest thread submits jobs, and workers only ever lower
+ * inflight, so a pool that is not full here stays not full until
+ * the following pool_submit().
+ */
+bool pool_full(pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    bool full = pool->inflight >= POOL_QUEUE_CAP;
+    pthread_mutex_unlock(&pool->lock);
+    return full;
+}
+
+// the jobs submitted and not yet compiled, racy but only a hint.
+u64 pool_depth(pool_t *pool) {
+    return __atomic_load_n(&pool->inflight, __ATOMIC_RELAXED);
+}
+
+void pool_submit(pool_t *pool, u64 pc, enum tier_t tier, u32 epoch, str_t source) {
+    compile_job_t *job = new_job(pc, tier, source);
+    job->epoch = epoch;
+    job->submitted = stats_now();
+
+    pthread_mutex_lock(&pool->lock);
+    assert(pool->inflight < POOL_QUEUE_CAP);
+    if (pool->pending_tail) pool->pending_tail->next = job;
+    else pool->pending = job;
+    pool->pending_tail = job;
+    pool->inflight++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * returns the list of finished units, chained through next.
+ * the common case of nothing being ready does not take the lock.
+ */
+compile_unit_t *pool_take(pool_t *pool) {
+    if (__atomic_load_n(&pool->ndone, __ATOMIC_ACQUIRE) == 0) return NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    compile_unit_t *units = pool->done;
+    pool->done = NULL;
+    __atomic_store_n(&pool->ndone, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pool->lock);
+    return units;
+}
@@ -0,0 +1,53 @@
+#include "rvemu.h"
+
+profile_t *new_profile() {
+    return (profile_t *)calloc(1, sizeof(profile_t));
+}
+
+/**
+ * returns the index of the branch's taken counter, the fall through counter
+ * follows it. branches are only added while the tier 1 code is generated.
+ */
+u64 profile_add_branch(profile_t *p, u64 pc) {
+    for (u64 i = 0; i < p->nbranches; i++) {
+        if (p->branch_pcs[i] == pc) return 2 * i;
+    }
+
+    if (p->nbranches == p->cap) {
+        p->cap = p->cap ? p->cap * 2 : 16;
+        p->branch_pcs = (u64 *)realloc(p->branch_pcs, p->cap * sizeof(u64));
+    }
+
+    p->branch_pcs[p->nbranches] = pc;
+    return 2 * p->nbranches++;
+}
+
+// the two counters of pc, NULL until they are allocated.
+static u64 *profile_counts(profile_t *p, u64 pc) {
+    if (p->counts == NULL) return NULL;
+    for (u64 i = 0; i < p->nbranches; i++) {
+        if (p->branch_pcs[i] == pc) return &p->counts[2 * i];
+    }
+    return NULL;
+}
+
+bool profile_branch(profile_t *p, u64 pc, u64 *taken, u64 *not_taken) {
+    u64 *counts = profile_counts(p, pc);
+    if (counts == NULL) return false;
+    *taken = counts[0];
+    *not_taken = counts[1];
+    return true;
+}
+
+/**
+ * an indirect jump takes the counters of a branch for a majority vote: the
+ * first holds the target it went to most, the second by how many jumps
+ * that target leads all the others together.
+ */
+bool profile_target(profile_t *p, u64 pc, u64 *target, u64 *lead) {
+    u64 *counts = profile_counts(p, pc);
+    if (counts == NULL || counts[0] == 0) return false;
+    *target = counts[0];
+    *lead = counts[1];
+    return true;
+}
@@ -1,12 +1,221 @@
 #include "rvemu.h"
 
+#include <getopt.h>
+#include <signal.h>
+
+options_t options = {
+    .jit_threads = -1,
+    .cache_size = CACHE_SIZE,
+};
+
+static void usage() {
+    fprintf(stderr,
+        "usage: rvemu [options] <program> [args...]\n"
+        "       rvemu --aot -o <object> <program>\n"
+        "       rvemu --serve=SOCKET\n"
+        "\n"
+        "options:\n"
+        "      --jit=BACKEND    clang, or cp to copy precompiled stencils\n"
+        "                       (default: clang if it is installed)\n"
+        "      --jit-policy=P   when blocks are hot enough to translate: fixed\n"
+        "                       counts, or adaptive ones that follow the\n"
+        "                       compile queue and decay over time\n"
+        "                       (default: adaptive)\n"
+        "  -j, --jit-threads=N  compile hot blocks on N background threads,\n"
+        "                       0 compiles them synchronously\n"
+        "                       (default: ncpu-1, at least 1, at most 8)\n"
+        "      --cache-dir=DIR  keep compiled blocks in DIR across runs\n"
+        "                       (default: $XDG_CACHE_HOME/rvemu or ~/.cache/rvemu)\n"
+        "      --no-disk-cache  do not read or write the on-disk cache\n"
+        "      --shared-cache   share compiled blocks through shared memory\n"
+        "                       with the other rvemu processes that run\n"
+        "                       the same program with it, removed when the\n"
+        "                       last of them exits, or by the next rvemu\n"
+        "                       started with it if that one died\n"
+        "      --cache-size=MB  memory for translated code, flushed whenever\n"
+        "                       it runs out, or KB with a K suffix\n"
+        "                       (default: 64, at least 16K, at most 1024)\n"
+        "      --aot            translate the whole program ahead of time\n"
+        "                       into the object given with -o, and exit\n"
+        "  -o, --output=FILE    where --aot writes the object\n"
+        "      --load-aot=FILE  start with the blocks of an --aot object\n"
+        "      --stats          report the time and sizes of each jit stage\n"
+        "                       at exit, and on SIGUSR1\n"
+        "      --stats-json=FILE  write the same report to FILE, as json\n"
+        "      --serve=SOCKET   run a compile server for other rvemu processes\n"
+        "      --compile-server=SOCKET\n"
+        "                       compile through the server at SOCKET, and\n"
+        "                       locally whenever it cannot be reached\n"
+        "      --verify         check each translation against the interpreter\n"
+        "                       the first few times it runs, and stop at the\n"
+        "                       first one that leaves different registers\n");
+    exit(1);
+}
+
+static char *default_cache_dir() {
+    static char buf[PATH_MAX];
+    char *xdg = getenv("XDG_CACHE_HOME");
+    char *home = getenv("HOME");
+    if (xdg && *xdg) snprintf(buf, sizeof(buf), "%s/rvemu", xdg);
+    else if (home && *home) snprintf(buf, sizeof(buf), "%s/.cache/rvemu", home);
+    else return NULL;
+    return buf;
+}
+
+enum {
+    opt_jit = 256,
+    opt_jit_policy,
+    opt_cache_dir,
+    opt_no_disk_cache,
+    opt_shared_cache,
+    opt_cache_size,
+    opt_aot,
+    opt_load_aot,
+    opt_stats,
+    opt_stats_json,
+    opt_serve,
+    opt_compile_server,
+    opt_verify,
+};
+
+static int parse_options(int argc, char *argv[]) {
+    static struct option longopts[] = {
+        {"jit",           required_argument, NULL, opt_jit},
+        {"jit-policy",    required_argument, NULL, opt_jit_policy},
+        {"jit-threads",   required_argument, NULL, 'j'},
+        {"cache-dir",     required_argument, NULL, opt_cache_dir},
+        {"no-disk-cache", no_argument,       NULL, opt_no_disk_cache},
+        {"shared-cache",  no_argument,       NULL, opt_shared_cache},
+        {"cache-size",    required_argument, NULL, opt_cache_size},
+        {"aot",           no_argument,       NULL, opt_aot},
+        {"output",        required_argument, NULL, 'o'},
+        {"load-aot",      required_argument, NULL, opt_load_aot},
+        {"stats",         no_argument,       NULL, opt_stats},
+        {"stats-json",    required_argument, NULL, opt_stats_json},
+        {"serve",         required_argument, NULL, opt_serve},
+        {"compile-server",required_argument, NULL, opt_compile_server},
+        {"verify",        no_argument,       NULL, opt_verify},
+        {"help",          no_argument,       NULL, 'h'},
+        {0},
+    };
+
+    bool disk_cache = true;
+    int c;
+    while ((c = getopt_long(argc, argv, "+j:o:h", longopts, NULL)) != -1) {
+        switch (c) {
+        case opt_jit:
+            if (strcmp(optarg, "clang") == 0) options.backend = backend_clang;
+            else if (strcmp(optarg, "cp") == 0) options.backend = backend_cp;
+            else usage();
+            break;
+        case opt_jit_policy:
+            if (strcmp(optarg, "adaptive") == 0) options.jit_policy = policy_adaptive;
+            else if (strcmp(optarg, "fixed") == 0) options.jit_policy = policy_fixed;
+            else usage();
+            break;
+        case 'j':
+            options.jit_threads = atoi(optarg);
+            break;
+        case opt_cache_dir:
+            options.cache_dir = optarg;
+            break;
+        case opt_no_disk_cache:
+            disk_cache = false;
+            break;
+        case opt_shared_cache:
+            options.shared_cache = true;
+            break;
+        case opt_cache_size:
+        {
+            // megabytes, or kilobytes with a K, which is mostly for testing flushes.
+            char *end;
+            options.cache_size = strtoull(optarg, &end, 10) * 1024;
+            if (*end == 'K') end++;
+            else options.cache_size *= 1024;
+            if (*end != '\0' || options.cache_size < CACHE_SIZE_MIN ||
+                options.cache_size > CACHE_SIZE_MAX)
+                usage();
+            break;
+        }
+        case opt_aot:
+            options.aot = true;
+            break;
+        case 'o':
+            options.output = optarg;
+            break;
+        case opt_load_aot:
+            options.aot_object = optarg;
+            break;
+        case opt_stats:
+            options.stats = true;
+            break;
+        case opt_stats_json:
+            options.stats_json = optarg;
+            break;
+        case opt_serve:
+            options.serve = optarg;
+            break;
+        case opt_compile_server:
+            options.compile_server = optarg;
+            break;
+        case opt_verify:
+            options.verify = true;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (!disk_cache) options.cache_dir = NULL;
+    else if (options.cache_dir == NULL) options.cache_dir = default_cache_dir();
+
+    if (options.serve) return optind;
+    if (optind >= argc) usage();
+    if (options.aot != (options.output != NULL)) usage();
+    if (options.aot && options.backend == backend_cp) usage();
+
+    if (options.backend == backend_auto)
+        options.backend = compile_available() ? backend_clang : backend_cp;
+
+    if (options.jit_threads < 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        options.jit_threads = MIN(MAX(ncpu - 1, 1), 8);
+    }
+
+    return optind;
+}
+
 int main(int argc, char *argv[]) {
-    assert(argc > 1);
+    int idx = parse_options(argc, argv);
+    // a clang that dies before it read its input fails that compile, not
+    // rvemu, on any thread. sys_write() raises it again for the guest.
+    signal(SIGPIPE, SIG_IGN);
+    if (options.stats || options.stats_json)
+        stats_init(options.stats, options.stats_json);
+    if (options.serve)
+        server_run(options.serve);
 
     machine_t machine = {0};
-    machine.cache = new_cache();
-    machine_load_program(&machine, argv[1]);
-    machine_setup(&machine, argc, argv);
+    smc_init(&machine);
+    machine.cache = new_cache(options.cache_size);
+    if (options.backend == backend_clang) {
+        if (options.cache_dir)
+            diskcache_init(options.cache_dir);
+        if (options.shared_cache)
+            shmcache_init(argv[idx]);
+        if (options.jit_threads > 0)
+            machine.pool = new_pool(options.jit_threads, &machine.state.exit_request);
+    }
+    machine_load_program(&machine, argv[idx]);
+
+    if (options.aot) {
+        aot_translate(&machine, argv[idx], options.output);
+        return 0;
+    }
+    if (options.aot_object)
+        aot_load(&machine, options.aot_object, argv[idx]);
+
+    machine_setup(&machine, argc - idx + 1, argv + idx - 1);
 
     while(true) {
         enum exit_reason_t reason = machine_step(&machine);
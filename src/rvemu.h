@@ -2,7 +2,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -76,10 +78,44 @@ typedef struct {
     i32 imm;
     i16 csr;
     enum insn_type_t type;
+    u8 rm; // the rounding mode of a conversion to an integer
     bool rvc;
     bool cont;
 } insn_t;
 
+/**
+ * rvemu.c
+ */
+enum backend_t {
+    backend_auto,
+    backend_clang,
+    backend_cp,
+};
+
+enum jit_policy_t {
+    policy_adaptive,
+    policy_fixed,
+};
+
+typedef struct {
+    int jit_threads;
+    enum backend_t backend;
+    enum jit_policy_t jit_policy;
+    char *cache_dir;
+    bool aot;
+    char *output;
+    char *aot_object;
+    bool stats;
+    char *stats_json;
+    char *serve;
+    char *compile_server;
+    bool shared_cache;
+    u64 cache_size;
+    bool verify;
+} options_t;
+
+extern options_t options;
+
 /**
  * stack.c
  */
@@ -87,12 +123,12 @@ typedef struct {
 typedef struct {
     i64 top;
     u64 elems[STACK_CAP];
-} stack_t;
+} pcstack_t;
 
-void stack_push(stack_t *, u64);
-bool stack_pop(stack_t *, u64 *);
-void stack_reset(stack_t *);
-void stack_print(stack_t *);
+void stack_push(pcstack_t *, u64);
+bool stack_pop(pcstack_t *, u64 *);
+void stack_reset(pcstack_t *);
+void stack_print(pcstack_t *);
 
 /**
  * str.c
@@ -123,48 +159,187 @@ inline size_t str_len(const str_t str) {
 }
 
 void str_clear(str_t);
+void str_free(str_t);
 
 str_t str_append(str_t, const char *);
 
 /**
  * mmu.c
 */
+#define MMU_MAX_WRITABLE 8
+
 typedef struct {
     u64 entry;
     u64 host_alloc;
     u64 alloc;
     u64 base;
+    // the writable segments, the memory from base on is writable as well.
+    struct {
+        u64 start;
+        u64 end;
+    } writable[MMU_MAX_WRITABLE];
+    int nwritable;
 } mmu_t;
 
 void mmu_load_elf(mmu_t *, int);
 u64 mmu_alloc(mmu_t *, i64);
+bool mmu_writable(mmu_t *, u64);
 
 inline void mmu_write(u64 addr, u8 *data, size_t len) {
     memcpy((void *)TO_HOST(addr), (void *)data, len);
 }
 
+/**
+ * profile.c
+*/
+#define PROFILE_SYMBOL "profile_%lx"
+
+/**
+ * branch counters of a tier 1 region, two per conditional branch: how
+ * often it was taken, and how often it fell through, and two per indirect
+ * jump, see profile_target(). counts is only allocated when the code is
+ * linked.
+ */
+typedef struct {
+    u64 nbranches;
+    u64 cap;
+    u64 *branch_pcs;
+    u64 *counts;
+    u64 ncounts; // the branches counts was allocated for
+    u64 ninsns;  // of the tier 1 region
+} profile_t;
+
+profile_t *new_profile();
+u64 profile_add_branch(profile_t *, u64);
+bool profile_branch(profile_t *, u64, u64 *, u64 *);
+bool profile_target(profile_t *, u64, u64 *, u64 *);
+
 /**
  * cache.c
 */
-#define CACHE_ENTRY_SIZE (64 * 1024)
-#define CACHE_SIZE       (64 * 1024 * 1024)
+#define CACHE_TABLE_SIZE (4 * 1024)        // entries at first, doubled as it fills
+#define CACHE_TABLE_MAX  (1024 * 1024)      // entries past which cold ones are dropped first
+#define CACHE_SIZE       (64 * 1024 * 1024) // default of --cache-size
+#define CACHE_SIZE_MIN   (16 * 1024)        // room for the dispatcher and a unit or two
+#define CACHE_SIZE_MAX   (1024 * 1024 * 1024) // its two views stay in reach of rel32
+#define CACHE_GAP        4096               // between code and data
+#define CACHE_HUGE_PAGE  (2 * 1024 * 1024)  // the views of the cache are aligned to it
+
+/**
+ * tier 1 is compiled quickly, with small regions and branch counters, once
+ * a block has been interpreted hot_count times. after tier2_count entries
+ * into its tier 1 code the region is compiled again, with large regions
+ * and the counters turned into branch hints. both thresholds move with
+ * --jit-policy, see cache_adapt().
+ */
+enum tier_t {
+    tier_none,
+    tier_fast,
+    tier_opt,
+};
 
 typedef struct {
-    u64 pc;
     u64 hot;
     u64 offset;
+    u8 queued;
+    u8 tier;
+    u16 decays; // of the cache, when hot was last brought up to date
+    u32 epoch;  // bumped when the guest code changes, see cache_invalidate()
+    profile_t *profile;
+    void **chain;
+    struct ic_t *ic;
 } cache_item_t;
 
+/**
+ * direct exits to a pc jump on through its chain slot, a pointer in the
+ * code cache that holds the code of pc once it has been compiled for good,
+ * and NULL until then, which leaves the exit to machine_step(). tier 1
+ * code is never chained to, its entries are counted by cache_lookup().
+ */
+#define CHAIN_SYMBOL "chain_%lx"
+
+/**
+ * the inline cache of a jalr, in the code cache as well: the last targets
+ * it went to that had final-tier code, and that code. a jalr whose target
+ * is not among them leaves its cache in state->ic for machine_step() to
+ * fill. the layout is repeated in CODEGEN_PROLOGUE.
+ */
+#define IC_SYMBOL "ic_%lx"
+#define IC_WAYS   4
+
+/**
+ * a jalr that misses its inline cache goes on to the dispatcher, code at
+ * the start of the cache that is never flushed. it looks the target up in
+ * the jump cache, a direct mapped table of the final-tier code of recent
+ * targets, and jumps there, and only returns to machine_step() on a miss.
+ */
+#define DISPATCH_SYMBOL "dispatch"
+#define JUMP_CACHE_SIZE 4096
+
 typedef struct {
-    u8 *jitcode;
-    u64 offset;
-    cache_item_t table[CACHE_ENTRY_SIZE];
+    u64 pc;
+    u8 *code;
+} jump_t;
+
+typedef struct ic_t {
+    u64 pcs[IC_WAYS];
+    u8 *code[IC_WAYS];
+    u64 hits; // since the last miss, counted with --stats only
+    u64 next; // the way the next miss fills
+} ic_t;
+
+/**
+ * when the code does not fit, the cache is flushed as a whole: every pc
+ * goes back to the interpreter and is compiled again once it is hot again.
+ * generation counts the flushes, code made before one is gone.
+ *
+ * the table is open addressed, with the pcs apart from the rest of the
+ * entries, so a probe walks over densely packed keys only.
+ */
+typedef struct {
+    u64 *pcs;
+    cache_item_t *items;
+    u64 mask;
+    u64 shift;
+    u64 count;
+    jump_t *jumps;
+    u8 *dispatch;
+    u8 *jitcode; // where the code runs, read-only
+    u8 *rw;      // the same memory, writable and not executable
+    u64 size;
+    u64 fixed;  // the end of the dispatcher, where flushed code starts
+    u64 offset; // the end of the code
+    u64 data;   // the start of the data, which fills the cache from its end
+    u64 promote;
+    u64 generation;
+    bool huge;  // backed by reserved huge pages
+    u64 hot_count;   // interpreted entries before tier 1
+    u64 tier2_count; // tier 1 entries before tier 2
+    u64 ticks;       // calls of cache_adapt()
+    u64 decayed;     // when the counters were halved last
+    u16 decays;      // how often, see cache_decay()
 } cache_t;
 
-cache_t *new_cache();
+cache_t *new_cache(u64);
 u8 *cache_lookup(cache_t *, u64);
-u8 *cache_add(cache_t *, u64, u8 *, size_t, u64);
-bool cache_hot(cache_t *, u64);
+u8 *cache_enter(cache_t *, u64, bool *);
+void cache_adapt(cache_t *, i64);
+u8 *cache_copy(cache_t *, u8 *, size_t, u64);
+u8 *cache_alloc(cache_t *, size_t, u64);
+u8 *cache_writable(cache_t *, u8 *);
+void cache_insert(cache_t *, u64, u8 *, enum tier_t);
+void cache_flush(cache_t *);
+bool cache_empty(cache_t *);
+void **cache_chain(cache_t *, u64);
+ic_t *cache_ic(cache_t *, u64);
+void cache_ic_fill(cache_t *, ic_t *, u64);
+void cache_ic_report(cache_t *);
+void cache_huge_report(cache_t *);
+void cache_invalidate(cache_t *, u64);
+void cache_invalidate_ics(cache_t *);
+u32 cache_epoch(cache_t *, u64);
+bool cache_queue(cache_t *, u64, enum tier_t);
+profile_t *cache_profile(cache_t *, u64);
 
 /**
  * state.c
@@ -175,6 +350,7 @@ enum exit_reason_t {
     indirect_branch,
     interp,
     ecall,
+    fence_i,
 };
 
 enum csr_t {
@@ -183,16 +359,170 @@ enum csr_t {
     fcsr   = 0x003,
 };
 
+/**
+ * the return stack. a call, a jal or jalr that links ra or t0, pushes the
+ * pc it returns to along with the chain slot of that pc, and a return, a
+ * jalr through one of them, pops it and jumps straight through the slot
+ * when its target is the pc on top, before it tries its inline cache. the
+ * stack is a ring: deep calls overwrite the oldest entries, and an entry
+ * is only ever taken for its own pc, so a wrong guess is merely a miss.
+ * the layout is repeated in CODEGEN_PROLOGUE.
+ */
+#define RET_STACK_SIZE 16
+#define LINK_REG(reg)  ((reg) == ra || (reg) == t0)
+
+typedef struct {
+    u64 pc;
+    void **slot;
+} ret_t;
+
 typedef struct {
     enum exit_reason_t exit_reason;
+    u32 exit_request; // set by other threads, chained blocks return to machine_step()
     u64 reenter_pc;
+    struct ic_t *ic;  // of the jalr that missed, see IC_SYMBOL
     u64 gp_regs[num_gp_regs];
     fp_reg_t fp_regs[num_fp_regs];
     u64 pc;
+    ret_t rets[RET_STACK_SIZE];
+    u32 ret_top;
 } state_t;
 
 void state_print_regs(state_t *);
 
+/**
+ * hash.c
+*/
+#define HASH_SEED 0xcbf29ce484222325ULL
+
+u64 hash_bytes(u64, const void *, size_t);
+
+/**
+ * stats.c
+*/
+enum stat_t {
+    stat_genblock_ns,
+    stat_compile_ns,
+    stat_link_ns,
+    stat_cp_ns,
+    stat_install_ns,   // from pool_submit() until the code is in the cache
+    stat_source_bytes,
+    stat_object_bytes,
+    stat_code_bytes,   // of the code cache, per unit or region
+    stat_region_insns,
+    stat_relocations,  // per unit
+    stat_flush_bytes,  // of the code cache, when it was flushed
+    stat_ic_hits,      // of a jalr's inline cache, between two misses or until the end
+    stat_huge_bytes,   // of the code on huge pages, when the cache was flushed or at the end
+    stat_smc_regions,  // dropped because a page of guest code they came from was written
+    num_stats,
+};
+
+extern bool stats_enabled;
+
+void stats_init(bool, const char *);
+u64 stats_now();
+void stats_record(enum stat_t, u64);
+void stats_report();
+void stats_poll();
+
+/**
+ * compile.c
+*/
+typedef struct {
+    u8 *buf;
+    size_t size;
+    void *map;
+    size_t map_size;
+    bool shared; // in the shared cache, not ours to free
+} object_t;
+
+/**
+ * regions handed to the compiler in one go end up in the same translation
+ * unit, each as its own function named after its entry pc.
+ */
+#define COMPILE_BATCH_MAX 16
+#define BLOCK_SYMBOL "block_%lx"
+
+typedef struct compile_job_t {
+    u64 pc;
+    enum tier_t tier;
+    u32 epoch; // of pc when the job was made, code of an older one is dropped
+    u64 key;
+    u64 submitted;
+    str_t source;
+    struct compile_job_t *next;
+} compile_job_t;
+
+typedef struct compile_unit_t {
+    object_t obj;
+    compile_job_t *jobs;
+    struct compile_unit_t *next;
+} compile_unit_t;
+
+bool compile_local(str_t, enum tier_t, object_t *);
+object_t compile_source(str_t, enum tier_t);
+void free_object(object_t *);
+compile_job_t *new_job(u64, enum tier_t, str_t);
+void free_job(compile_job_t *);
+compile_unit_t *compile_jobs(compile_job_t *);
+void free_unit(compile_unit_t *);
+bool compile_available();
+
+/**
+ * libclang.cc
+*/
+#ifdef RVEMU_LIBCLANG
+const char *libclang_version();
+u8 *libclang_compile(const char *, size_t, int, size_t *);
+#endif
+
+/**
+ * diskcache.c
+*/
+void diskcache_init(const char *);
+bool diskcache_enabled();
+bool diskcache_load(compile_job_t *, object_t *);
+void diskcache_store(compile_job_t *, object_t *);
+
+/**
+ * shmcache.c
+*/
+void shmcache_init(const char *);
+bool shmcache_enabled();
+bool shmcache_load(compile_job_t *, object_t *);
+void shmcache_store(compile_job_t *, object_t *);
+
+/**
+ * server.c
+*/
+void server_run(const char *);
+bool server_compile(str_t, enum tier_t, object_t *);
+
+/**
+ * pool.c
+*/
+#define POOL_QUEUE_CAP 64
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    compile_job_t *pending;
+    compile_job_t *pending_tail;
+    compile_unit_t *done;
+    u64 inflight;
+    u64 ndone;
+    int nthreads;
+    pthread_t *threads;
+    u32 *exit_request;
+} pool_t;
+
+pool_t *new_pool(int, u32 *);
+bool pool_full(pool_t *);
+u64 pool_depth(pool_t *);
+void pool_submit(pool_t *, u64, enum tier_t, u32, str_t);
+compile_unit_t *pool_take(pool_t *);
+
 /**
  * machine.c
 */
@@ -200,6 +530,8 @@ typedef struct {
     state_t state;
     mmu_t mmu;
     cache_t *cache;
+    pool_t *pool;
+    u64 generation; // of the cache, when the return stack was last emptied
 } machine_t;
 
 typedef void (*exec_block_func_t)(state_t *);
@@ -215,15 +547,119 @@ inline void machine_set_gp_reg(machine_t *m, i32 reg, u64 data) {
 }
 
 void machine_setup(machine_t *, int, char **);
-str_t machine_genblock(machine_t *);
-u8 *machine_compile(machine_t *, str_t);
+// end the block at calls instead of following them into the callee.
+#define GEN_SPLIT_CALLS (1 << 0)
+// count how often each conditional branch goes which way, into profile.
+#define GEN_PROFILE     (1 << 1)
+// turn the counts in profile into branch hints.
+#define GEN_HINTS       (1 << 2)
+// go on through indirect jumps into the targets they took in tier 1.
+#define GEN_TRACES      (1 << 3)
+
+typedef struct {
+    u32 flags;
+    u64 max_insns; // 0 for no limit, past it every path ends in an exit
+    profile_t *profile;
+} genopts_t;
+
+const char *machine_genheader();
+str_t machine_genblock(machine_t *, genopts_t *);
+u8 *machine_compile(machine_t *, enum tier_t, str_t);
 enum exit_reason_t machine_step(machine_t *);
 void machine_load_program(machine_t *, char*);
 
+/**
+ * ir.c
+*/
+typedef struct {
+    u64 pc;
+    insn_t insn;
+    u64 target;   // of the branch or jump, when the region goes on there, else 0
+    u32 preds;    // ways in from the region, and from outside for the entry
+    bool exit;    // past max_insns, only an exit to pc
+    bool chained; // the only way in is from the instruction before
+    bool known;   // rd is set to value
+    bool dead;    // rd is written again before it is read
+    u64 value;
+} ir_node_t;
+
+typedef struct {
+    ir_node_t *nodes; // the entry first, then in the order they are printed
+    u64 len;
+    u64 cap;
+    u64 ninsns;       // that are not exits
+    u64 *pcs;         // the index of nodes by pc
+    u32 *slots;
+    u64 mask;
+} ir_region_t;
+
+void ir_build(machine_t *, genopts_t *, ir_region_t *);
+void ir_optimize(ir_region_t *);
+ir_node_t *ir_node(ir_region_t *, u64);
+bool ir_writes_gp(insn_t *);
+
+/**
+ * link.c
+*/
+void machine_link(machine_t *, compile_unit_t *);
+
+/**
+ * aot.c
+*/
+void aot_translate(machine_t *, const char *, const char *);
+void aot_load(machine_t *, const char *, const char *);
+
+/**
+ * cp.c
+*/
+
+/**
+ * what goes into a hole of a stencil, see src/stencils/stencils.c. next and
+ * taken are rel32 jumps to other guest pcs, the rest are values.
+ */
+enum hole_t {
+    hole_rd,
+    hole_rs1,
+    hole_rs2,
+    hole_imm,
+    hole_pc,
+    hole_ret,
+    hole_target,
+    hole_reason,
+    hole_insn,
+    hole_interp,
+    hole_next,
+    hole_taken,
+    hole_slot,
+    hole_ic,
+    hole_dispatch,
+    hole_jumps,
+    hole_stats,
+};
+
+typedef struct {
+    u64 offset;
+    enum hole_t kind;
+    u32 type; // R_X86_64_*
+    i64 addend;
+} cp_hole_t;
+
+typedef struct {
+    const u8 *code;
+    u64 size;
+    const cp_hole_t *holes;
+    u64 nholes;
+    bool falls; // ends by falling through into the next stencil
+} cp_stencil_t;
+
+u8 *cp_translate(machine_t *);
+u8 *cp_dispatch(cache_t *);
+
 /**
  * interp.c
 */
 void exec_block_interp(state_t *);
+void exec_insn_interp(state_t *, insn_t *);
 
 /**
  * set.c
@@ -245,6 +681,19 @@ void set_reset(set_t *);
 
 void insn_decode(insn_t *, u32);
 
+/**
+ * smc.c
+*/
+void smc_init(machine_t *);
+void smc_watch(machine_t *, u64, u64, u64);
+void smc_write(machine_t *, u64, u64);
+void smc_sync(machine_t *);
+
+/**
+ * verify.c
+*/
+void verify_run(machine_t *, u8 *);
+
 /**
  * syscall.c
 */
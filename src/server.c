@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+#include "rvemu.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * a compile server shared by the rvemu processes of a host, started with
+ * `rvemu --serve=SOCKET` and used by the ones run with --compile-server.
+ * a client sends the source of a translation unit and its tier, and gets
+ * the object back. the server keeps the objects it made in memory, and a
+ * unit that is being compiled for one client is waited for by the others
+ * instead of being compiled again.
+ *
+ * the server is only an optimization: whenever it cannot be reached or
+ * fails, the client compiles on its own.
+ */
+
+#define SERVER_MAGIC     0x3153524556455652ULL // "RVEVERS1", bumped with the format
+#define SERVER_BUCKETS   4096
+#define SERVER_CACHE_MAX (256 * 1024 * 1024)
+#define SERVER_MSG_MAX   (64 * 1024 * 1024) // of a source or an object, larger ones are refused
+#define SERVER_TIMEOUT   30                 // seconds a peer may keep a read or a write waiting
+
+typedef struct {
+    u64 magic;
+    u64 tier;
+    u64 size; // of the source that follows, or of the object, 0 if it failed
+} server_msg_t;
+
+static bool write_all(int fd, const void *buf, size_t len) {
+    for (size_t off = 0; off < len;) {
+        ssize_t n = send(fd, (const u8 *)buf + off, len - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        off += n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void *buf, size_t len) {
+    for (size_t off = 0; off < len;) {
+        ssize_t n = read(fd, (u8 *)buf + off, len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        off += n;
+    }
+    return true;
+}
+
+// a peer that stops talking fails the read or the write, instead of hanging it.
+static void set_timeouts(int fd) {
+    struct timeval tv = { .tv_sec = SERVER_TIMEOUT };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static bool socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) return false;
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+bool server_compile(str_t source, enum tier_t tier, object_t *obj) {
+    if (options.compile_server == NULL) return false;
+
+    struct sockaddr_un addr;
+    if (!socket_address(options.compile_server, &addr)) return false;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return false;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return false;
+    }
+    set_timeouts(fd);
+
+    server_msg_t msg = { SERVER_MAGIC, tier, str_len(source) };
+    bool ok = msg.size <= SERVER_MSG_MAX &&
+              write_all(fd, &msg, sizeof(msg)) && write_all(fd, source, msg.size) &&
+              read_all(fd, &msg, sizeof(msg)) && msg.magic == SERVER_MAGIC &&
+              msg.size != 0 && msg.size <= SERVER_MSG_MAX;
+    if (ok) {
+        obj->buf = (u8 *)malloc(msg.size);
+        obj->size = msg.size;
+        ok = read_all(fd, obj->buf, obj->size);
+        if (!ok) free(obj->buf);
+    }
+
+    close(fd);
+    return ok;
+}
+
+/**
+ * a translation unit the server has been asked for. users keeps an entry
+ * that is being waited on or sent out from being evicted.
+ */
+typedef struct entry_t {
+    u64 key;
+    u64 tier;
+    char *source;
+    size_t source_size;
+    u8 *obj;
+    size_t obj_size;
+    bool done;
+    u64 users;
+    struct entry_t *next;
+    struct entry_t *newer;
+} entry_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    entry_t *buckets[SERVER_BUCKETS];
+    entry_t *oldest;
+    entry_t *newest;
+    u64 bytes;
+} server = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+// unlinks e, which follows prev from the oldest entry on, and frees it.
+static void server_remove(entry_t **link, entry_t *prev) {
+    entry_t *e = *link;
+    *link = e->newer;
+    if (server.newest == e) server.newest = prev;
+
+    entry_t **chain = &server.buckets[e->key % SERVER_BUCKETS];
+    while (*chain != e) chain = &(*chain)->next;
+    *chain = e->next;
+
+    server.bytes -= e->source_size + e->obj_size;
+    free(e->source);
+    free(e->obj);
+    free(e);
+}
+
+static void server_evict() {
+    entry_t **link = &server.oldest, *prev = NULL;
+    while (server.bytes > SERVER_CACHE_MAX && *link != NULL) {
+        entry_t *e = *link;
+        if (!e->done || e->users > 0) {
+            prev = e;
+            link = &e->newer;
+            continue;
+        }
+        server_remove(link, prev);
+    }
+}
+
+/**
+ * a failed compile is not kept once everyone who waited for it was told,
+ * clang may have failed for a reason of its own, like running out of
+ * memory, and the next one to ask tries again.
+ */
+static void server_forget(entry_t *failed) {
+    entry_t **link = &server.oldest, *prev = NULL;
+    while (*link != failed) {
+        prev = *link;
+        link = &prev->newer;
+    }
+    server_remove(link, prev);
+}
+
+/**
+ * finds the entry of the unit, compiling it if no one has yet. returns with
+ * a use of the entry taken, and the lock released.
+ */
+static entry_t *server_get(u64 tier, char *source, size_t size) {
+    u64 key = hash_bytes(hash_bytes(HASH_SEED, &tier, sizeof(tier)), source, size);
+
+    pthread_mutex_lock(&server.lock);
+    entry_t *e = server.buckets[key % SERVER_BUCKETS];
+    while (e != NULL && !(e->key == key && e->tier == tier && e->source_size == size &&
+                          memcmp(e->source, source, size) == 0))
+        e = e->next;
+
+    if (e != NULL) {
+        e->users++;
+        while (!e->done) pthread_cond_wait(&server.cond, &server.lock);
+        pthread_mutex_unlock(&server.lock);
+        free(source);
+        return e;
+    }
+
+    e = (entry_t *)calloc(1, sizeof(entry_t));
+    e->key = key;
+    e->tier = tier;
+    e->source = source;
+    e->source_size = size;
+    e->users = 1;
+    e->next = server.buckets[key % SERVER_BUCKETS];
+    server.buckets[key % SERVER_BUCKETS] = e;
+    if (server.newest) server.newest->newer = e;
+    else server.oldest = e;
+    server.newest = e;
+    pthread_mutex_unlock(&server.lock);
+
+    str_t str = str_append(str_new(), source);
+    object_t obj = {0};
+    compile_local(str, (enum tier_t)tier, &obj);
+    str_free(str);
+
+    pthread_mutex_lock(&server.lock);
+    e->obj = obj.buf;
+    e->obj_size = obj.buf ? obj.size : 0;
+    e->done = true;
+    server.bytes += e->source_size + e->obj_size;
+    server_evict();
+    pthread_cond_broadcast(&server.cond);
+    pthread_mutex_unlock(&server.lock);
+    return e;
+}
+
+static void server_handle(int fd) {
+    set_timeouts(fd);
+    server_msg_t msg;
+    if (!read_all(fd, &msg, sizeof(msg)) || msg.magic != SERVER_MAGIC ||
+        (msg.tier != tier_fast && msg.tier != tier_opt) || msg.size > SERVER_MSG_MAX)
+        return;
+
+    // the source goes through str_append(), which stops at a nul.
+    char *source = (char *)malloc(msg.size + 1);
+    if (!read_all(fd, source, msg.size) || memchr(source, '\0', msg.size) != NULL) {
+        free(source);
+        return;
+    }
+    source[msg.size] = '\0';
+
+    // a size of 0 tells the client that clang failed, it compiles on its own then.
+    entry_t *e = server_get(msg.tier, source, msg.size);
+    msg.size = e->obj_size;
+    if (write_all(fd, &msg, sizeof(msg))) write_all(fd, e->obj, e->obj_size);
+
+    pthread_mutex_lock(&server.lock);
+    if (--e->users == 0 && e->obj == NULL) server_forget(e);
+    pthread_mutex_unlock(&server.lock);
+}
+
+static void *server_worker(void *arg) {
+    int listen_fd = (int)(intptr_t)arg;
+    while (true) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fatal(strerror(errno));
+        }
+        server_handle(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * serves until killed, with one thread per cpu, each accepting and
+ * compiling one request at a time.
+ */
+void server_run(const char *path) {
+    struct sockaddr_un addr;
+    if (!socket_address(path, &addr)) fatalf("%s: socket path too long", path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) fatal(strerror(errno));
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        fatalf("%s: a compile server is already running there", path);
+
+    // a socket left behind by a server that is gone.
+    close(fd);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) fatal(strerror(errno));
+    if (unlink(path) != 0 && errno != ENOENT) fatalf("%s: %s", path, strerror(errno));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0)
+        fatalf("%s: %s", path, strerror(errno));
+
+    long nthreads = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    for (long i = 1; i < nthreads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, server_worker, (void *)(intptr_t)fd) != 0)
+            fatal("cannot create server thread");
+    }
+
+    fprintf(stderr, "rvemu: compile server listening on %s\n", path);
+    server_worker((void *)(intptr_t)fd);
+}
@@ -0,0 +1,242 @@
+#include "rvemu.h"
+
+#include <dirent.h>
+#include <sys/file.h>
+
+/**
+ * translations shared by the rvemu processes that run the same program,
+ * with --shared-cache: a segment of shared memory, named after a hash of
+ * the program, that holds the objects clang made for any of them. another
+ * process finds a unit there instead of compiling it, and only links it
+ * into its own code cache, as it does with the disk cache.
+ *
+ * the segment is an append-only log of entries, laid out like the files of
+ * the disk cache, and an index of their offsets by key. a writer takes its
+ * room in the log with an atomic add, fills it in, and only then publishes
+ * the offset into an empty slot of the index with a compare and swap, so
+ * no one waits for anyone and readers never see half an entry. a full log
+ * or index simply takes nothing more.
+ *
+ * a segment lives as long as a process uses it: each one holds a shared
+ * flock on it until it exits, and the last one out removes it. segments
+ * whose last user died without doing so are removed by the next rvemu
+ * that starts with --shared-cache. a process that finds the log full
+ * removes its name too, so the processes started after it begin with an
+ * empty segment, while the ones that have it keep sharing what is in it.
+ */
+
+#define SHMCACHE_MAGIC 0x3143485345565221ULL
+#define SHMCACHE_SIZE  (256 * 1024 * 1024) // of the segment, pages are only used once written
+#define SHMCACHE_SLOTS (64 * 1024)
+#define SHMCACHE_PROBE 64                  // slots tried before a lookup gives up
+
+typedef struct {
+    u64 magic;
+    u64 end; // of the log
+    u64 slots[SHMCACHE_SLOTS];
+} shmcache_hdr_t;
+
+typedef struct {
+    u64 nblocks;
+    u64 obj_size;
+} shmcache_entry_t;
+
+typedef struct {
+    u64 key;
+    u64 source_size;
+} shmcache_block_t;
+
+static u8 *segment = NULL;
+static char segment_name[64];
+static int segment_fd = -1; // holds the flock
+
+// removes the segments no process holds a flock on.
+static void shmcache_sweep() {
+    DIR *dir = opendir("/dev/shm");
+    if (dir == NULL) return;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strncmp(ent->d_name, "rvemu-", 6) != 0) continue;
+        char name[NAME_MAX + 2];
+        snprintf(name, sizeof(name), "/%s", ent->d_name);
+        int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+        if (fd == -1) continue;
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0) shm_unlink(name);
+        close(fd);
+    }
+    closedir(dir);
+}
+
+// removes the name of the segment, if it is still ours.
+static void shmcache_unlink() {
+    struct stat ours, named;
+    int fd = shm_open(segment_name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd == -1) return;
+    if (fstat(segment_fd, &ours) == 0 && fstat(fd, &named) == 0 && ours.st_ino == named.st_ino)
+        shm_unlink(segment_name);
+    close(fd);
+}
+
+static void shmcache_exit() {
+    if (flock(segment_fd, LOCK_EX | LOCK_NB) == 0) shmcache_unlink();
+}
+
+static shmcache_hdr_t *header() {
+    return (shmcache_hdr_t *)segment;
+}
+
+/**
+ * opens the segment of prog, or makes it. the process that makes it sets
+ * it up, the others wait until it has.
+ */
+void shmcache_init(const char *prog) {
+    int fd = open(prog, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) fatalf("%s: %s", prog, strerror(errno));
+    u8 *buf = (u8 *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf == MAP_FAILED) fatalf("%s: %s", prog, strerror(errno));
+    close(fd);
+
+    char *name = segment_name;
+    snprintf(name, sizeof(segment_name), "/rvemu-%016lx", hash_bytes(HASH_SEED, buf, st.st_size));
+    munmap(buf, st.st_size);
+    shmcache_sweep();
+
+    bool owner = true;
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1 && errno == EEXIST) {
+        owner = false;
+        fd = shm_open(name, O_RDWR | O_CLOEXEC, 0600);
+    }
+    if (fd == -1) return;
+    if (flock(fd, LOCK_SH) != 0 || (owner && ftruncate(fd, SHMCACHE_SIZE) != 0)) {
+        close(fd);
+        return;
+    }
+
+    for (int tries = 0; !owner; tries++) {
+        if (fstat(fd, &st) == 0 && st.st_size == SHMCACHE_SIZE) break;
+        if (tries == 100) {
+            close(fd);
+            return;
+        }
+        usleep(1000);
+    }
+
+    u8 *map = (u8 *)mmap(NULL, SHMCACHE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+
+    shmcache_hdr_t *hdr = (shmcache_hdr_t *)map;
+    if (owner) {
+        hdr->end = ROUNDUP(sizeof(shmcache_hdr_t), 8);
+        __atomic_store_n(&hdr->magic, SHMCACHE_MAGIC, __ATOMIC_RELEASE);
+    }
+    for (int tries = 0; __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHMCACHE_MAGIC; tries++) {
+        if (tries == 100) {
+            munmap(map, SHMCACHE_SIZE);
+            close(fd);
+            return;
+        }
+        usleep(1000);
+    }
+    segment = map;
+    segment_fd = fd;
+    atexit(shmcache_exit);
+}
+
+bool shmcache_enabled() {
+    return segment != NULL;
+}
+
+/**
+ * whether the entry at off holds the source of job, and where its object
+ * is if it does.
+ */
+static bool shmcache_match(u64 off, compile_job_t *job, object_t *obj) {
+    if (off < sizeof(shmcache_hdr_t) || SHMCACHE_SIZE - off < sizeof(shmcache_entry_t))
+        return false;
+    shmcache_entry_t *entry = (shmcache_entry_t *)(segment + off);
+    off += sizeof(shmcache_entry_t);
+
+    bool found = false;
+    for (u64 i = 0; i < entry->nblocks; i++) {
+        if (SHMCACHE_SIZE - off < sizeof(shmcache_block_t)) return false;
+        shmcache_block_t *block = (shmcache_block_t *)(segment + off);
+        off += sizeof(shmcache_block_t);
+
+        if (SHMCACHE_SIZE - off < ROUNDUP(block->source_size, 8)) return false;
+        if (block->key == job->key && block->source_size == str_len(job->source) &&
+            memcmp(segment + off, job->source, block->source_size) == 0)
+            found = true;
+        off += ROUNDUP(block->source_size, 8);
+    }
+
+    if (!found || SHMCACHE_SIZE - off < entry->obj_size) return false;
+    obj->buf = segment + off;
+    obj->size = entry->obj_size;
+    obj->shared = true;
+    return true;
+}
+
+bool shmcache_load(compile_job_t *job, object_t *obj) {
+    if (segment == NULL) return false;
+
+    for (u64 i = 0; i < SHMCACHE_PROBE; i++) {
+        u64 *slot = &header()->slots[(job->key + i) % SHMCACHE_SLOTS];
+        u64 off = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        if (off == 0) return false;
+        if (shmcache_match(off, job, obj)) return true;
+    }
+    return false;
+}
+
+// publishes the entry at off under the key of job.
+static void shmcache_publish(compile_job_t *job, u64 off) {
+    for (u64 i = 0; i < SHMCACHE_PROBE; i++) {
+        u64 *slot = &header()->slots[(job->key + i) % SHMCACHE_SLOTS];
+        u64 cur = 0;
+        if (__atomic_compare_exchange_n(slot, &cur, off, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            return;
+
+        // someone else was faster with the same unit.
+        object_t obj;
+        if (shmcache_match(cur, job, &obj)) return;
+    }
+}
+
+void shmcache_store(compile_job_t *jobs, object_t *obj) {
+    if (segment == NULL) return;
+
+    u64 size = sizeof(shmcache_entry_t) + obj->size;
+    shmcache_entry_t entry = { .obj_size = obj->size };
+    for (compile_job_t *job = jobs; job != NULL; job = job->next) {
+        size += sizeof(shmcache_block_t) + ROUNDUP(str_len(job->source), 8);
+        entry.nblocks++;
+    }
+    size = ROUNDUP(size, 8);
+
+    u64 start = __atomic_fetch_add(&header()->end, size, __ATOMIC_RELAXED);
+    if (start > SHMCACHE_SIZE || SHMCACHE_SIZE - start < size) {
+        static bool unlinked = false;
+        if (!__atomic_exchange_n(&unlinked, true, __ATOMIC_RELAXED)) shmcache_unlink();
+        return;
+    }
+
+    u8 *p = segment + start;
+    memcpy(p, &entry, sizeof(entry));
+    p += sizeof(entry);
+    for (compile_job_t *job = jobs; job != NULL; job = job->next) {
+        shmcache_block_t block = { job->key, str_len(job->source) };
+        memcpy(p, &block, sizeof(block));
+        p += sizeof(block);
+        memcpy(p, job->source, block.source_size);
+        p += ROUNDUP(block.source_size, 8);
+    }
+    memcpy(p, obj->buf, obj->size);
+
+    for (compile_job_t *job = jobs; job != NULL; job = job->next)
+        shmcache_publish(job, start);
+}
@@ -0,0 +1,178 @@
+#include "rvemu.h"
+
+#include <signal.h>
+
+/**
+ * self-modifying code. every writable guest page that code has been
+ * translated from is write-protected, and knows the regions that were.
+ * a store to it faults: the page is made writable again and marked
+ * written, and the regions are dropped the next time the guest passes
+ * through machine_step(), which a fence.i makes sure of right away.
+ * until then the code that is running may still be the old one, as the
+ * guest has to expect without a fence.i.
+ *
+ * pages that are not writable to begin with are not watched at all, a
+ * store to them is as fatal as it always was.
+ */
+
+#define SMC_TABLE_SIZE 256 // pages at first, doubled as it fills
+
+typedef struct {
+    u64 *pcs; // the entries of the regions translated from the page
+    u32 npcs;
+    u32 cap;
+    bool protected;
+    bool written;
+} smc_page_t;
+
+static struct {
+    machine_t *m;
+    u64 page_size;
+    u64 *keys; // page numbers, 0 for a free entry
+    smc_page_t *pages;
+    u64 mask;
+    u64 count;
+    u64 last_entry; // of the last smc_watch(), which is asked about
+    u64 last_page;  // the same page over and over
+    volatile sig_atomic_t written;
+} smc;
+
+static void smc_table_init(u64 cap) {
+    smc.keys = (u64 *)calloc(cap, sizeof(u64));
+    smc.pages = (smc_page_t *)calloc(cap, sizeof(smc_page_t));
+    smc.mask = cap - 1;
+    smc.count = 0;
+}
+
+static inline u64 smc_probe(u64 page) {
+    u64 index = (page * 0x9e3779b97f4a7c15ULL) & smc.mask;
+    while (smc.keys[index] != page && smc.keys[index] != 0)
+        index = (index + 1) & smc.mask;
+    return index;
+}
+
+static smc_page_t *smc_find(u64 page) {
+    u64 index = smc_probe(page);
+    return smc.keys[index] == page ? &smc.pages[index] : NULL;
+}
+
+static smc_page_t *smc_add(u64 page) {
+    u64 index = smc_probe(page);
+    if (smc.keys[index] == page) return &smc.pages[index];
+
+    if (2 * (smc.count + 1) > smc.mask + 1) {
+        u64 *keys = smc.keys, cap = smc.mask + 1;
+        smc_page_t *pages = smc.pages;
+        smc_table_init(cap * 2);
+        for (u64 i = 0; i < cap; i++) {
+            if (keys[i] == 0) continue;
+            u64 j = smc_probe(keys[i]);
+            smc.keys[j] = keys[i];
+            smc.pages[j] = pages[i];
+            smc.count++;
+        }
+        free(keys);
+        free(pages);
+        index = smc_probe(page);
+    }
+    smc.keys[index] = page;
+    smc.count++;
+    return &smc.pages[index];
+}
+
+static void smc_unprotect(u64 page, smc_page_t *p) {
+    if (p->protected)
+        mprotect((void *)TO_HOST(page * smc.page_size), smc.page_size, PROT_READ | PROT_WRITE);
+    p->protected = false;
+    p->written = true;
+    smc.written = 1;
+    smc.m->state.exit_request = 1;
+}
+
+static void on_sigsegv(int sig, siginfo_t *info, void *ucontext) {
+    u64 page = TO_GUEST((u64)info->si_addr) / smc.page_size;
+    smc_page_t *p = info->si_code == SEGV_ACCERR && page != 0 ? smc_find(page) : NULL;
+    if (p == NULL || !p->protected) {
+        // not a store to translated code, the fault comes again, and kills.
+        signal(SIGSEGV, SIG_DFL);
+        return;
+    }
+    smc_unprotect(page, p);
+}
+
+void smc_init(machine_t *m) {
+    smc.m = m;
+    smc.page_size = getpagesize();
+    smc_table_init(SMC_TABLE_SIZE);
+
+    struct sigaction sa = {0};
+    sa.sa_sigaction = on_sigsegv;
+    sa.sa_flags = SA_SIGINFO;
+    sigaction(SIGSEGV, &sa, NULL);
+}
+
+/**
+ * the region at entry is translated from the len bytes at pc. their pages
+ * are protected from then on, until they are written.
+ */
+void smc_watch(machine_t *m, u64 entry, u64 pc, u64 len) {
+    for (u64 page = pc / smc.page_size; page <= (pc + len - 1) / smc.page_size; page++) {
+        if (entry == smc.last_entry && page == smc.last_page) continue;
+        smc.last_entry = entry;
+        smc.last_page = page;
+        if (!mmu_writable(&m->mmu, page * smc.page_size)) continue;
+
+        smc_page_t *p = smc_add(page);
+        bool seen = false;
+        for (u32 i = 0; i < p->npcs && !seen; i++) seen = p->pcs[i] == entry;
+        if (!seen) {
+            if (p->npcs == p->cap) {
+                p->cap = p->cap ? p->cap * 2 : 4;
+                p->pcs = (u64 *)realloc(p->pcs, p->cap * sizeof(u64));
+            }
+            p->pcs[p->npcs++] = entry;
+        }
+
+        if (!p->protected)
+            mprotect((void *)TO_HOST(page * smc.page_size), smc.page_size, PROT_READ);
+        p->protected = true;
+    }
+}
+
+/**
+ * the host is about to write len bytes at addr for the guest, in a syscall,
+ * where a protected page would make it fail instead of fault.
+ */
+void smc_write(machine_t *m, u64 addr, u64 len) {
+    if (len == 0) return;
+    u64 last = addr + len - 1 < addr ? UINT64_MAX : addr + len - 1;
+    // the guest says how long, the pages that are watched are few.
+    for (u64 i = 0; i <= smc.mask; i++) {
+        u64 page = smc.keys[i];
+        if (page == 0 || page < addr / smc.page_size || page > last / smc.page_size) continue;
+        if (smc.pages[i].npcs > 0) smc_unprotect(page, &smc.pages[i]);
+    }
+}
+
+/**
+ * drops the regions of every page written since the last time. the guest
+ * thread calls it between two blocks, where no translated code runs.
+ */
+void smc_sync(machine_t *m) {
+    if (!smc.written) return;
+    smc.written = 0;
+
+    bool invalidated = false;
+    for (u64 i = 0; i <= smc.mask; i++) {
+        smc_page_t *p = &smc.pages[i];
+        if (smc.keys[i] == 0 || !p->written) continue;
+
+        stats_record(stat_smc_regions, p->npcs);
+        for (u32 j = 0; j < p->npcs; j++) cache_invalidate(m->cache, p->pcs[j]);
+        invalidated |= p->npcs > 0;
+        p->npcs = 0;
+        p->written = false;
+    }
+    if (invalidated) cache_invalidate_ics(m->cache);
+    smc.last_entry = 0;
+}
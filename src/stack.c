@@ -1,6 +1,6 @@
 #include "rvemu.h"
 
-void stack_push(stack_t *stack, u64 elem) {
+void stack_push(pcstack_t *stack, u64 elem) {
     assert(stack->top < STACK_CAP);
 
     // check for duplicates
@@ -11,17 +11,17 @@ void stack_push(stack_t *stack, u64 elem) {
     stack->elems[stack->top++] = elem;
 }
 
-bool stack_pop(stack_t *stack, u64 *elem) {
+bool stack_pop(pcstack_t *stack, u64 *elem) {
     if (stack->top == 0) return false;
     *elem = stack->elems[--stack->top];
     return true;
 }
 
-void stack_reset(stack_t *stack) {
+void stack_reset(pcstack_t *stack) {
     stack->top = 0;
 }
 
-void stack_print(stack_t *stack) {
+void stack_print(pcstack_t *stack) {
     printf("[ ");
     for (int i = 0; i < stack->top; i++) {
         printf("0x%lx ", stack->elems[i]);
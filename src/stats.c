@@ -0,0 +1,190 @@
+#include "rvemu.h"
+
+#include <signal.h>
+#include <time.h>
+
+/**
+ * counters of the jit pipeline. every stat is a histogram with a bucket per
+ * power of two, filled from the guest thread and the compiler threads alike
+ * with atomic adds. nothing is recorded unless --stats or --stats-json ask
+ * for it, then the histograms are reported when rvemu exits, and whenever
+ * it gets SIGUSR1.
+ */
+
+#define STATS_BUCKETS 65
+
+typedef struct {
+    u64 count;
+    u64 sum;
+    u64 min;
+    u64 max;
+    u64 buckets[STATS_BUCKETS];
+} histogram_t;
+
+static const struct {
+    const char *name;
+    bool time;
+} stat_info[] = {
+    [stat_genblock_ns]   = { "genblock_ns",   true  },
+    [stat_compile_ns]    = { "compile_ns",    true  },
+    [stat_link_ns]       = { "link_ns",       true  },
+    [stat_cp_ns]         = { "cp_ns",         true  },
+    [stat_install_ns]    = { "install_ns",    true  },
+    [stat_source_bytes]  = { "source_bytes",  false },
+    [stat_object_bytes]  = { "object_bytes",  false },
+    [stat_code_bytes]    = { "code_bytes",    false },
+    [stat_region_insns]  = { "region_insns",  false },
+    [stat_relocations]   = { "relocations",   false },
+    [stat_flush_bytes]   = { "flush_bytes",   false },
+    [stat_ic_hits]       = { "ic_hits",       false },
+    [stat_huge_bytes]    = { "huge_bytes",    false },
+    [stat_smc_regions]   = { "smc_regions",   false },
+};
+
+bool stats_enabled = false;
+
+static histogram_t stats[num_stats];
+static bool print_text;
+static const char *json_path;
+static volatile sig_atomic_t report_requested;
+
+u64 stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// bucket 0 holds zeros, bucket i the values in [2^(i-1), 2^i).
+static inline int bucket_of(u64 val) {
+    return val == 0 ? 0 : 64 - __builtin_clzll(val);
+}
+
+static inline u64 bucket_low(int i) {
+    return i == 0 ? 0 : 1ULL << (i - 1);
+}
+
+void stats_record(enum stat_t stat, u64 val) {
+    if (!stats_enabled) return;
+
+    histogram_t *h = &stats[stat];
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, val, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[bucket_of(val)], 1, __ATOMIC_RELAXED);
+
+    u64 min = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    while (val < min &&
+           !__atomic_compare_exchange_n(&h->min, &min, val, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    u64 max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (val > max &&
+           !__atomic_compare_exchange_n(&h->max, &max, val, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * the value below which a fraction p of the samples lie, interpolated
+ * linearly within its bucket.
+ */
+static u64 percentile(histogram_t *h, double p) {
+    if (h->count == 0) return 0;
+
+    double rank = p * h->count;
+    u64 seen = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        if (h->buckets[i] == 0) continue;
+        if (seen + h->buckets[i] >= rank) {
+            u64 lo = MAX(bucket_low(i), h->min);
+            u64 hi = MIN(i == 0 ? 0 : bucket_low(i) * 2 - 1, h->max);
+            return lo + (u64)((hi - lo) * ((rank - seen) / h->buckets[i]));
+        }
+        seen += h->buckets[i];
+    }
+    return h->max;
+}
+
+static void format_value(char *buf, size_t size, u64 val, bool time) {
+    if (!time) snprintf(buf, size, "%lu", val);
+    else if (val < 10000) snprintf(buf, size, "%luns", val);
+    else if (val < 10000000) snprintf(buf, size, "%.1fus", val / 1e3);
+    else if (val < 10000000000ULL) snprintf(buf, size, "%.1fms", val / 1e6);
+    else snprintf(buf, size, "%.1fs", val / 1e9);
+}
+
+static void stats_print(FILE *file) {
+    fprintf(file, "%-14s %8s %10s %10s %10s %10s %10s %10s\n",
+            "rvemu stats", "count", "total", "mean", "p50", "p90", "p99", "max");
+
+    for (int i = 0; i < num_stats; i++) {
+        histogram_t *h = &stats[i];
+        if (h->count == 0) continue;
+
+        u64 vals[] = { h->sum, h->sum / h->count, percentile(h, 0.5),
+                       percentile(h, 0.9), percentile(h, 0.99), h->max };
+        fprintf(file, "%-14s %8lu", stat_info[i].name, h->count);
+        for (u64 j = 0; j < ARRAY_SIZE(vals); j++) {
+            char buf[32];
+            format_value(buf, sizeof(buf), vals[j], stat_info[i].time);
+            fprintf(file, " %10s", buf);
+        }
+        fprintf(file, "\n");
+    }
+}
+
+static void stats_write_json(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "rvemu: %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    fprintf(file, "{");
+    for (int i = 0; i < num_stats; i++) {
+        histogram_t *h = &stats[i];
+        fprintf(file, "%s\n  \"%s\": {\"count\": %lu, \"sum\": %lu, \"min\": %lu, \"max\": %lu, "
+                "\"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"buckets\": [",
+                i ? "," : "", stat_info[i].name, h->count, h->sum, h->count ? h->min : 0, h->max,
+                percentile(h, 0.5), percentile(h, 0.9), percentile(h, 0.99));
+
+        bool first = true;
+        for (int j = 0; j < STATS_BUCKETS; j++) {
+            if (h->buckets[j] == 0) continue;
+            fprintf(file, "%s[%lu, %lu]", first ? "" : ", ", bucket_low(j), h->buckets[j]);
+            first = false;
+        }
+        fprintf(file, "]}");
+    }
+    fprintf(file, "\n}\n");
+    fclose(file);
+}
+
+void stats_report() {
+    if (!stats_enabled) return;
+    if (print_text) stats_print(stderr);
+    if (json_path) stats_write_json(json_path);
+}
+
+static void on_sigusr1(int sig) {
+    report_requested = 1;
+}
+
+/**
+ * SIGUSR1 only sets a flag, the report is made by the guest thread the
+ * next time it passes through here.
+ */
+void stats_poll() {
+    if (!report_requested) return;
+    report_requested = 0;
+    stats_report();
+}
+
+void stats_init(bool print, const char *json) {
+    stats_enabled = true;
+    print_text = print;
+    json_path = json;
+    for (int i = 0; i < num_stats; i++) stats[i].min = UINT64_MAX;
+
+    struct sigaction sa = {0};
+    sa.sa_handler = on_sigusr1;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    atexit(stats_report);
+}
@@ -0,0 +1,186 @@
+/**
+ * turns the object compiled from stencils.c into obj/stencils.h, run once
+ * when rvemu is built. every function becomes a stencil: its machine code,
+ * and a hole for every relocation, which must be against a HOLE_* symbol.
+ * a jump to HOLE_NEXT at the very end is dropped, the backend places the
+ * next stencil right there whenever it can.
+ *
+ * jumps into translated code go through registers, and are only checked
+ * to be jumps: a stencil that calls and then returns would grow the host
+ * stack with every chained exit, and is rejected.
+ */
+#include "../rvemu.h"
+
+#include <ctype.h>
+
+#define STT_FUNC 2
+
+static u8 *read_file(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) fatalf("%s: %s", path, strerror(errno));
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    u8 *buf = (u8 *)malloc(size);
+    if (fread(buf, 1, size, file) != (size_t)size) fatalf("%s: %s", path, strerror(errno));
+    fclose(file);
+    return buf;
+}
+
+typedef struct {
+    u64 offset;
+    const char *kind;
+    u32 type;
+    i64 addend;
+} reloc_t;
+
+static int compare_reloc(const void *a, const void *b) {
+    const reloc_t *x = (const reloc_t *)a, *y = (const reloc_t *)b;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// jmp rel32, or jcc rel32.
+static bool is_jump(u8 *code, u64 offset) {
+    if (offset >= 1 && code[offset - 1] == 0xe9) return true;
+    return offset >= 2 && code[offset - 2] == 0x0f && (code[offset - 1] & 0xf0) == 0x80;
+}
+
+// the length of the indirect call, call *r/m64, at offset, 0 if there is none.
+static u64 call_len(u8 *code, u64 offset, u64 size) {
+    u64 p = offset;
+    if (p < size && (code[p] & 0xf0) == 0x40) p++; // rex
+    if (size - p < 2 || code[p] != 0xff || (code[p + 1] & 0x38) != 0x10) return 0;
+
+    u8 mod = code[p + 1] >> 6, rm = code[p + 1] & 7;
+    p += 2;
+    if (mod == 3) return p - offset;
+    if (rm == 4) p++; // sib
+    if (mod == 1) p += 1;
+    else if (mod == 2 || (mod == 0 && rm == 5)) p += 4;
+    return p <= size ? p - offset : 0;
+}
+
+// a call followed by nothing but restoring the stack and ret, a tail call the compiler kept.
+static bool is_call_ret(u8 *code, u64 offset, u64 size) {
+    u64 len = call_len(code, offset, size);
+    if (len == 0) return false;
+
+    u64 p = offset + len;
+    while (p < size) {
+        if (size - p >= 4 && code[p] == 0x48 && code[p + 1] == 0x83 && code[p + 2] == 0xc4)
+            p += 4; // add $imm8, %rsp
+        else if ((code[p] & 0xf8) == 0x58)
+            p += 1; // pop
+        else if (size - p >= 2 && code[p] == 0x41 && (code[p + 1] & 0xf8) == 0x58)
+            p += 2;
+        else
+            break;
+    }
+    return p < size && code[p] == 0xc3;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: stencilgen <stencils.o>\n");
+        exit(1);
+    }
+
+    u8 *elfbuf = read_file(argv[1]);
+    elf64_ehdr_t *ehdr = (elf64_ehdr_t *)elfbuf;
+    elf64_shdr_t *shdrs = (elf64_shdr_t *)(elfbuf + ehdr->e_shoff);
+
+    elf64_shdr_t *symtab = NULL;
+    for (i64 idx = 0; idx < ehdr->e_shnum; idx++) {
+        if (shdrs[idx].sh_type == SHT_SYMTAB) symtab = &shdrs[idx];
+    }
+    if (symtab == NULL) fatal("no symbol table");
+
+    elf64_sym_t *syms = (elf64_sym_t *)(elfbuf + symtab->sh_offset);
+    char *strtab = (char *)(elfbuf + shdrs[symtab->sh_link].sh_offset);
+    i64 nsyms = symtab->sh_size / sizeof(elf64_sym_t);
+
+    printf("// generated by stencilgen from %s, do not edit.\n\n", argv[1]);
+
+    char **ops = (char **)calloc(nsyms, sizeof(char *));
+    i64 nops = 0;
+    for (i64 i = 0; i < nsyms; i++) {
+        elf64_sym_t *sym = &syms[i];
+        if ((sym->st_info & 0xf) != STT_FUNC) continue;
+
+        char *name = strtab + sym->st_name;
+        // -ffunction-sections gives every stencil a section of its own.
+        if (sym->st_shndx == SHN_UNDEF || sym->st_value != 0)
+            fatalf("%s: not in a section of its own", name);
+        u8 *code = elfbuf + shdrs[sym->st_shndx].sh_offset;
+        u64 size = sym->st_size;
+        for (u64 j = 0; j < size; j++)
+            if (is_call_ret(code, j, size)) fatalf("%s: calls at %lu what it should jump to", name, j);
+
+        reloc_t *holes = NULL;
+        u64 nholes = 0;
+        for (i64 idx = 0; idx < ehdr->e_shnum; idx++) {
+            elf64_shdr_t *shdr = &shdrs[idx];
+            if (shdr->sh_type != SHT_RELA || shdr->sh_info != sym->st_shndx) continue;
+
+            i64 rels = shdr->sh_size / sizeof(elf64_rela_t);
+            holes = (reloc_t *)realloc(holes, (nholes + rels) * sizeof(reloc_t));
+            for (i64 j = 0; j < rels; j++) {
+                elf64_rela_t *rel = (elf64_rela_t *)(elfbuf + shdr->sh_offset) + j;
+                char *target = strtab + syms[rel->r_sym].st_name;
+                if (strncmp(target, "HOLE_", 5) != 0)
+                    fatalf("%s: refers to %s, which is not a hole", name, target);
+
+                bool jump = strcmp(target, "HOLE_NEXT") == 0 || strcmp(target, "HOLE_TAKEN") == 0;
+                bool pc32 = rel->r_type == R_X86_64_PC32 || rel->r_type == R_X86_64_PLT32;
+                if (jump && (!pc32 || !is_jump(code, rel->r_offset)))
+                    fatalf("%s: %s is not reached by a tail call", name, target);
+
+                holes[nholes++] = (reloc_t){ rel->r_offset, target + 5, rel->r_type, rel->r_addend };
+            }
+        }
+        qsort(holes, nholes, sizeof(reloc_t), compare_reloc);
+
+        bool falls = false;
+        if (nholes > 0 && holes[nholes - 1].offset == size - 4 &&
+            strcmp(holes[nholes - 1].kind, "NEXT") == 0 && code[size - 5] == 0xe9) {
+            size -= 5;
+            nholes--;
+            falls = true;
+        }
+
+        printf("static const u8 stencil_%s_code[] = {", name);
+        for (u64 j = 0; j < size; j++)
+            printf("%s0x%02x,", j % 12 == 0 ? "\n    " : " ", code[j]);
+        printf("\n};\n");
+
+        if (nholes > 0) {
+            printf("static const cp_hole_t stencil_%s_holes[] = {\n", name);
+            for (u64 j = 0; j < nholes; j++) {
+                printf("    { %lu, hole_", holes[j].offset);
+                for (const char *c = holes[j].kind; *c; c++) putchar(tolower(*c));
+                printf(", %u, %ld },\n", holes[j].type, holes[j].addend);
+            }
+            printf("};\n");
+        }
+
+        printf("static const cp_stencil_t stencil_%s = {\n", name);
+        printf("    stencil_%s_code, %lu, ", name, size);
+        if (nholes > 0) printf("stencil_%s_holes, %lu, ", name, nholes);
+        else printf("NULL, 0, ");
+        printf("%s,\n};\n\n", falls ? "true" : "false");
+
+        if (strncmp(name, "op_", 3) == 0) ops[nops++] = name;
+        free(holes);
+    }
+
+    printf("static const cp_stencil_t *const op_stencils[num_insns] = {\n");
+    for (i64 i = 0; i < nops; i++)
+        printf("    [insn_%s] = &stencil_%s,\n", ops[i] + 3, ops[i]);
+    printf("};\n");
+
+    free(ops);
+    free(elfbuf);
+    return 0;
+}
@@ -0,0 +1,287 @@
+/**
+ * the stencils of the copy-and-patch backend, see cp.c. each function is
+ * compiled once, when rvemu is built, and stencilgen turns its machine code
+ * into a template the backend copies and patches at runtime.
+ *
+ * a stencil runs with the guest state in the first argument register and
+ * ends in a tail call to HOLE_NEXT, which becomes a jump to the next
+ * stencil, or nothing at all when that stencil is placed right behind it.
+ * the other holes are extern symbols as well, their relocations tell where
+ * the registers, immediates and pcs of an instruction go.
+ */
+#include "../rvemu.h"
+
+// byte offsets of guest registers in state_t.
+extern char HOLE_RD[], HOLE_RS1[], HOLE_RS2[];
+// the exit reason of leave.
+extern char HOLE_REASON[];
+
+extern void HOLE_NEXT(state_t *);
+extern void HOLE_TAKEN(state_t *);
+
+#define RD  (*(u64 *)((u8 *)state + (u64)HOLE_RD))
+#define RS1 (*(u64 *)((u8 *)state + (u64)HOLE_RS1))
+#define RS2 (*(u64 *)((u8 *)state + (u64)HOLE_RS2))
+
+// the immediate fits a sign extended imm32, the rest can be anything.
+#define IMM ({ i64 v_; __asm__("movq $HOLE_IMM, %0" : "=r"(v_)); v_; })
+#define HOLE64(name) ({ u64 v_; __asm__("movabs $" #name ", %0" : "=r"(v_)); v_; })
+
+// 1 with --stats, 0 otherwise.
+#define STATS ({ u32 v_; __asm__("movl $HOLE_STATS, %0" : "=r"(v_)); v_; })
+
+#define PC     HOLE64(HOLE_PC)
+#define RET    HOLE64(HOLE_RET)
+#define TARGET HOLE64(HOLE_TARGET)
+
+// reads of registers before it stay before it, see ALU.
+#define BARRIER() __asm__ volatile("" ::: "memory")
+
+/**
+ * a call into translated code that must be a jump, or every chained exit
+ * would grow the host stack. clang guarantees it, stencilgen checks it
+ * where the compiler does not.
+ */
+#if __has_attribute(musttail)
+#define TAIL(call) __attribute__((musttail)) return call
+#else
+#define TAIL(call) do { call; return; } while (0)
+#endif
+
+/**
+ * the compiler takes two holes for two different objects, so every stencil
+ * reads all of its registers before it writes rd, which may be one of them.
+ */
+#define ALU(name, expr)                  \
+    void op_##name(state_t *state) {     \
+        u64 rs1 = RS1;                   \
+        u64 rs2 = RS2;                   \
+        RD = (expr);                     \
+        HOLE_NEXT(state);                \
+    }                                    \
+
+ALU(add, rs1 + rs2)
+ALU(sub, rs1 - rs2)
+ALU(sll, rs1 << (rs2 & 0x3f))
+ALU(slt, (i64)rs1 < (i64)rs2)
+ALU(sltu, rs1 < rs2)
+ALU(xor, rs1 ^ rs2)
+ALU(srl, rs1 >> (rs2 & 0x3f))
+ALU(sra, (i64)rs1 >> (rs2 & 0x3f))
+ALU(or, rs1 | rs2)
+ALU(and, rs1 & rs2)
+ALU(mul, rs1 * rs2)
+ALU(addw, (i64)(i32)(rs1 + rs2))
+ALU(subw, (i64)(i32)(rs1 - rs2))
+ALU(sllw, (i64)(i32)(rs1 << (rs2 & 0x1f)))
+ALU(srlw, (i64)(i32)((u32)rs1 >> (rs2 & 0x1f)))
+ALU(sraw, (i64)((i32)rs1 >> (rs2 & 0x1f)))
+ALU(mulw, (i64)(i32)(rs1 * rs2))
+
+#undef ALU
+
+#define ALU(name, expr)                  \
+    void op_##name(state_t *state) {     \
+        u64 rs1 = RS1;                   \
+        i64 imm = IMM;                   \
+        RD = (expr);                     \
+        HOLE_NEXT(state);                \
+    }                                    \
+
+ALU(addi, rs1 + imm)
+ALU(slti, (i64)rs1 < imm)
+ALU(sltiu, rs1 < (u64)imm)
+ALU(xori, rs1 ^ imm)
+ALU(ori, rs1 | imm)
+ALU(andi, rs1 & imm)
+ALU(slli, rs1 << (imm & 0x3f))
+ALU(srli, rs1 >> (imm & 0x3f))
+ALU(srai, (i64)rs1 >> (imm & 0x3f))
+ALU(addiw, (i64)(i32)(rs1 + imm))
+ALU(slliw, (i64)(i32)(rs1 << (imm & 0x1f)))
+ALU(srliw, (i64)(i32)((u32)rs1 >> (imm & 0x1f)))
+ALU(sraiw, (i64)((i32)rs1 >> (imm & 0x1f)))
+
+#undef ALU
+
+void op_lui(state_t *state) {
+    RD = IMM;
+    HOLE_NEXT(state);
+}
+
+void op_auipc(state_t *state) {
+    RD = PC + IMM;
+    HOLE_NEXT(state);
+}
+
+#define LOAD(name, typ)                               \
+    void op_##name(state_t *state) {                  \
+        u64 addr = RS1 + IMM;                         \
+        RD = *(typ *)TO_HOST(addr);                   \
+        HOLE_NEXT(state);                             \
+    }                                                 \
+
+LOAD(lb, i8)
+LOAD(lh, i16)
+LOAD(lw, i32)
+LOAD(ld, i64)
+LOAD(lbu, u8)
+LOAD(lhu, u16)
+LOAD(lwu, u32)
+
+#undef LOAD
+
+#define STORE(name, typ)                              \
+    void op_##name(state_t *state) {                  \
+        u64 addr = RS1 + IMM;                         \
+        *(typ *)TO_HOST(addr) = (typ)RS2;             \
+        HOLE_NEXT(state);                             \
+    }                                                 \
+
+STORE(sb, u8)
+STORE(sh, u16)
+STORE(sw, u32)
+STORE(sd, u64)
+
+#undef STORE
+
+#define BRANCH(name, cond)               \
+    void op_##name(state_t *state) {     \
+        u64 rs1 = RS1;                   \
+        u64 rs2 = RS2;                   \
+        if (cond) HOLE_TAKEN(state);     \
+        else HOLE_NEXT(state);           \
+    }                                    \
+
+BRANCH(beq, rs1 == rs2)
+BRANCH(bne, rs1 != rs2)
+BRANCH(blt, (i64)rs1 < (i64)rs2)
+BRANCH(bge, (i64)rs1 >= (i64)rs2)
+BRANCH(bltu, rs1 < rs2)
+BRANCH(bgeu, rs1 >= rs2)
+
+#undef BRANCH
+
+// a call, HOLE_NEXT is the callee.
+void op_jal(state_t *state) {
+    RD = RET;
+    HOLE_NEXT(state);
+}
+
+/**
+ * where to go on to target: its code in the inline cache of the jalr, see
+ * IC_SYMBOL, or the dispatcher, with the cache left to it to fill.
+ */
+static inline __attribute__((always_inline)) exec_block_func_t indirect(state_t *state, u64 target) {
+    state->exit_reason = indirect_branch;
+    state->reenter_pc = target;
+
+    ic_t *ic = (ic_t *)HOLE64(HOLE_IC);
+    for (int i = 0; i < IC_WAYS; i++) {
+        if (ic->pcs[i] != target) continue;
+        if (STATS) ic->hits++;
+        return (exec_block_func_t)ic->code[i];
+    }
+    state->ic = ic;
+    return (exec_block_func_t)HOLE64(HOLE_DISPATCH);
+}
+
+/**
+ * rd does not depend on the target, so without the barrier the compiler
+ * may read rs1 after rd is written, as in the `auipc ra; jalr ra` of a call.
+ */
+void op_jalr(state_t *state) {
+    u64 target = (RS1 + IMM) & ~(u64)1;
+    BARRIER();
+    RD = RET;
+    exec_block_func_t next = indirect(state, target);
+    if (!state->exit_request) TAIL(next(state));
+}
+
+// jalr with rd == zero, an indirect jump.
+void jr(state_t *state) {
+    exec_block_func_t next = indirect(state, (RS1 + IMM) & ~(u64)1);
+    if (!state->exit_request) TAIL(next(state));
+}
+
+// pushes RET with its chain slot, see RET_STACK_SIZE.
+static inline __attribute__((always_inline)) void push(state_t *state) {
+    u32 top = (state->ret_top + 1) % RET_STACK_SIZE;
+    state->rets[top].pc = RET;
+    state->rets[top].slot = (void **)HOLE64(HOLE_SLOT);
+    state->ret_top = top;
+}
+
+// jal and jalr that link, HOLE_NEXT is the callee of call.
+void call(state_t *state) {
+    RD = RET;
+    push(state);
+    HOLE_NEXT(state);
+}
+
+void call_jalr(state_t *state) {
+    u64 target = (RS1 + IMM) & ~(u64)1;
+    BARRIER();
+    RD = RET;
+    push(state);
+    exec_block_func_t next = indirect(state, target);
+    if (!state->exit_request) TAIL(next(state));
+}
+
+// a return goes where the pc on top of the return stack is compiled to.
+void ret(state_t *state) {
+    u64 target = (RS1 + IMM) & ~(u64)1;
+    u32 top = state->ret_top;
+    state->ret_top = (top - 1) % RET_STACK_SIZE;
+
+    exec_block_func_t next = NULL;
+    if (state->rets[top].pc == target) next = *(exec_block_func_t *)state->rets[top].slot;
+    if (next == NULL) {
+        next = indirect(state, target);
+    } else {
+        state->exit_reason = indirect_branch;
+        state->reenter_pc = target;
+    }
+    if (!state->exit_request) TAIL(next(state));
+}
+
+void leave(state_t *state) {
+    state->exit_reason = (enum exit_reason_t)(u64)HOLE_REASON;
+    state->reenter_pc = TARGET;
+}
+
+// a direct exit, which jumps on into the target once it is compiled.
+void chain(state_t *state) {
+    state->exit_reason = direct_branch;
+    state->reenter_pc = TARGET;
+    exec_block_func_t next = *(exec_block_func_t *)HOLE64(HOLE_SLOT);
+    if (next != NULL && !state->exit_request) TAIL(next(state));
+}
+
+/**
+ * the dispatcher, see DISPATCH_SYMBOL. it is entered with the target in
+ * reenter_pc and the inline cache that missed it in ic, and fills in the
+ * cache itself when the jump cache has the target.
+ */
+void dispatch(state_t *state) {
+    u64 pc = state->reenter_pc;
+    jump_t *jump = (jump_t *)HOLE64(HOLE_JUMPS) + (pc >> 1) % JUMP_CACHE_SIZE;
+    if (jump->pc != pc) return;
+
+    ic_t *ic = state->ic;
+    ic->pcs[ic->next] = pc;
+    ic->code[ic->next] = jump->code;
+    ic->next = (ic->next + 1) % IC_WAYS;
+    state->ic = NULL;
+    TAIL(((exec_block_func_t)jump->code)(state));
+}
+
+/**
+ * every other instruction that does not end the block goes through the
+ * interpreter, with the decoded instruction kept next to the code.
+ */
+void fallback(state_t *state) {
+    state->pc = PC;
+    ((void (*)(state_t *, insn_t *))HOLE64(HOLE_INTERP))(state, (insn_t *)HOLE64(HOLE_INSN));
+    HOLE_NEXT(state);
+}
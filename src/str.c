@@ -42,3 +42,7 @@ void str_clear(str_t str) {
     str_setlen(str, 0);
     str[0] = '\0';
 }
+
+void str_free(str_t str) {
+    free(STRHDR(str));
+}
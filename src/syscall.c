@@ -1,5 +1,7 @@
 #include "rvemu.h"
 
+#include <signal.h>
+
 // Copied from https://github.com/riscv-software-src/riscv-pk
 #define SYS_exit 93
 #define SYS_exit_group 94
@@ -77,6 +79,10 @@ static u64 sys_unimplemented(machine_t *m) {
 
 static u64 sys_exit(machine_t *m) {
     GET(a0, code);
+    if (stats_enabled) {
+        cache_ic_report(m->cache);
+        cache_huge_report(m->cache);
+    }
     exit(code);
 }
 
@@ -88,16 +94,25 @@ static u64 sys_close(machine_t *m) {
 
 static u64 sys_write(machine_t *m) {
     GET(a0, fd); GET(a1, ptr); GET(a2, len);
-    return write(fd, (void *)TO_HOST(ptr), (size_t)len);
+    ssize_t n = write(fd, (void *)TO_HOST(ptr), (size_t)len);
+    // rvemu ignores SIGPIPE for its clang pipes, the guest would not have.
+    if (n < 0 && errno == EPIPE) {
+        signal(SIGPIPE, SIG_DFL);
+        raise(SIGPIPE);
+    }
+    return n;
 }
 
 static u64 sys_fstat(machine_t *m) {
     GET(a0, fd); GET(a1, addr);
+    smc_write(m, addr, sizeof(struct stat));
     return fstat(fd, (struct stat *)TO_HOST(addr));
 }
 
 static u64 sys_gettimeofday(machine_t *m) {
     GET(a0, tv_addr); GET(a1, tz_addr);
+    smc_write(m, tv_addr, sizeof(struct timeval));
+    if (tz_addr != 0) smc_write(m, tz_addr, sizeof(struct timezone));
     struct timeval *tv = (struct timeval *)TO_HOST(tv_addr);
     struct timezone *tz = NULL;
     if (tz_addr != 0) tz = (struct timezone *)TO_HOST(tz_addr);
@@ -109,6 +124,8 @@ static u64 sys_brk(machine_t *m) {
     if (addr == 0) addr = m->mmu.alloc;
     assert(addr >= m->mmu.base);
     i64 incr = (i64)addr - m->mmu.alloc;
+    // memory given back takes the code translated from it along.
+    if (incr < 0) smc_write(m, addr, -incr);
     mmu_alloc(&m->mmu, incr);
     return addr;
 }
@@ -154,6 +171,7 @@ static u64 sys_lseek(machine_t *m) {
 
 static u64 sys_read(machine_t *m) {
     GET(a0, fd); GET(a1, bufptr); GET(a2, count);
+    smc_write(m, bufptr, count);
     return read(fd, (char *)TO_HOST(bufptr), (size_t)count);
 }
 
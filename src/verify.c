@@ -0,0 +1,138 @@
+#include "rvemu.h"
+
+#include <sys/wait.h>
+
+/**
+ * --verify runs every translation against the interpreter, the first
+ * VERIFY_RUNS times it is entered. a child is forked right before the
+ * translated code runs, so it has the memory the code starts from, and
+ * steps the interpreter from the same state until that state matches the
+ * one the code left, passed through a pipe: the pc it goes on at, and
+ * all registers. a child that gets to an ecall, or past VERIFY_MAX_STEPS,
+ * without a match reports what differs where the pcs last agreed, and
+ * rvemu stops. guest memory is not compared.
+ *
+ * a translation only runs one region at a time while it is verified,
+ * exit_request keeps it from chaining into the next.
+ */
+
+#define VERIFY_RUNS      4
+#define VERIFY_SLOTS     (64 * 1024) // translations counted, the rest run unverified
+#define VERIFY_MAX_STEPS (1ULL << 30)
+
+typedef struct {
+    u64 pc;
+    u8 *code;
+    u64 runs;
+} verify_slot_t;
+
+static verify_slot_t slots[VERIFY_SLOTS];
+static u64 slots_generation;
+
+/**
+ * whether the code of pc has yet to run VERIFY_RUNS times. a flush places
+ * new code where the old was, so the counts start over with every
+ * generation of the cache.
+ */
+static bool verify_due(machine_t *m, u8 *code) {
+    if (slots_generation != m->cache->generation) {
+        memset(slots, 0, sizeof(slots));
+        slots_generation = m->cache->generation;
+    }
+
+    u64 pc = m->state.pc;
+    u64 index = hash_bytes(hash_bytes(HASH_SEED, &pc, sizeof(pc)), &code, sizeof(code)) % VERIFY_SLOTS;
+    for (u64 i = 0; i < VERIFY_SLOTS; i++, index = (index + 1) % VERIFY_SLOTS) {
+        verify_slot_t *slot = &slots[index];
+        if (slot->code == NULL) *slot = (verify_slot_t){ pc, code, 0 };
+        if (slot->pc == pc && slot->code == code) return slot->runs++ < VERIFY_RUNS;
+    }
+    return false;
+}
+
+// whether a and b agree on every register.
+static bool verify_same(state_t *a, state_t *b) {
+    for (int i = 1; i < num_gp_regs; i++)
+        if (a->gp_regs[i] != b->gp_regs[i]) return false;
+    for (int i = 0; i < num_fp_regs; i++)
+        if (a->fp_regs[i].v != b->fp_regs[i].v) return false;
+    return true;
+}
+
+// the child runs without stdio, whose locks another thread may have held at fork().
+static void verify_report(u64 entry, state_t *interp, state_t *jit) {
+    dprintf(2, "rvemu: verify: the region at %lx goes on at %lx, the interpreter at %lx\n",
+            entry, jit->reenter_pc, interp->pc);
+    for (int i = 1; i < num_gp_regs; i++) {
+        if (interp->gp_regs[i] == jit->gp_regs[i]) continue;
+        dprintf(2, "  x%d: %lx, the interpreter has %lx\n", i, jit->gp_regs[i], interp->gp_regs[i]);
+    }
+    for (int i = 0; i < num_fp_regs; i++) {
+        if (interp->fp_regs[i].v == jit->fp_regs[i].v) continue;
+        dprintf(2, "  f%d: %lx, the interpreter has %lx\n", i, jit->fp_regs[i].v, interp->fp_regs[i].v);
+    }
+}
+
+/**
+ * steps the interpreter from state until it matches jit. ecalls and
+ * fence.i leave the region before they run, with the pc after them.
+ */
+static bool verify_interp(state_t *state, state_t *jit) {
+    u64 stop = jit->reenter_pc;
+    if (jit->exit_reason == ecall || jit->exit_reason == fence_i) stop -= 4;
+
+    state_t last = *state;
+    insn_t insn;
+    for (u64 steps = 0; steps < VERIFY_MAX_STEPS; steps++) {
+        if (state->pc == stop) {
+            if (verify_same(state, jit)) return true;
+            last = *state;
+        }
+
+        insn_decode(&insn, *(u32 *)TO_HOST(state->pc));
+        if (insn.type == insn_ecall) break;
+
+        state->exit_reason = none;
+        exec_insn_interp(state, &insn);
+        if (state->exit_reason != none) state->pc = state->reenter_pc;
+        else state->pc += insn.rvc ? 2 : 4;
+    }
+
+    verify_report(jit->pc, &last, jit);
+    return false;
+}
+
+void verify_run(machine_t *m, u8 *code) {
+    if (!verify_due(m, code)) {
+        ((exec_block_func_t)code)(&m->state);
+        return;
+    }
+
+    int fds[2];
+    if (pipe(fds) != 0) fatalf("verify: %s", strerror(errno));
+    state_t before = m->state;
+
+    pid_t pid = fork();
+    if (pid == -1) fatalf("verify: %s", strerror(errno));
+    if (pid == 0) {
+        close(fds[1]);
+        state_t jit;
+        if (read(fds[0], &jit, sizeof(jit)) != sizeof(jit)) _exit(2);
+        _exit(verify_interp(&before, &jit) ? 0 : 1);
+    }
+    close(fds[0]);
+
+    m->state.exit_request = 1;
+    ((exec_block_func_t)code)(&m->state);
+
+    state_t after = m->state;
+    after.pc = before.pc; // the entry, for the report
+    if (write(fds[1], &after, sizeof(after)) != sizeof(after)) fatalf("verify: %s", strerror(errno));
+    close(fds[1]);
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1)
+        if (errno != EINTR) fatalf("verify: %s", strerror(errno));
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fatalf("verify: the region at %lx does not match the interpreter", before.pc);
+}
@@ -0,0 +1,54 @@
+/**
+ * calls many small functions in a loop, with a code cache too small for
+ * the translations of all of them, so that it is flushed over and over,
+ * while units are linked and while the guest runs, and checks the exit
+ * code under every backend.
+ *
+ * usage: cache_flush <rvemu>
+ */
+#include "guest.h"
+
+#define FUNCS 200
+#define LOOPS 3000
+#define FIRST (FUNCS + 6) // index of the first function, after the loop and the exit
+
+static uint32_t code[FIRST + 2 * FUNCS];
+
+// the counters of the adaptive policy decay faster than a loop this long
+// heats its blocks, unless the compile queue drives the thresholds down.
+// at 24K and 32K a flush lands while a unit places its data, after its code.
+static const char *const argsets[][4] = {
+    { "--jit-policy=fixed", "--cache-size=16K", NULL },
+    { "--jit-policy=fixed", "-j0", "--cache-size=16K", NULL },
+    { "--jit-policy=fixed", "-j0", "--cache-size=24K", NULL },
+    { "--jit-policy=fixed", "-j0", "--cache-size=32K", NULL },
+    { "--jit=cp", "--cache-size=16K", NULL },
+    { "--jit=cp", "--verify", "--cache-size=16K", NULL },
+};
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <rvemu>\n", argv[0]);
+        return 1;
+    }
+
+    int n = 0, sum = 0;
+    code[n++] = LUI(s0, LOOPS - LO12(LOOPS));
+    code[n++] = ADDI(s0, s0, LO12(LOOPS));
+    for (int i = 0; i < FUNCS; i++, n++)
+        code[n] = JAL(ra, (FIRST + 2 * i - n) * 4);
+    code[n++] = ADDI(s0, s0, -1);
+    code[n] = BNE(s0, zero, (2 - n) * 4);
+    n++;
+    code[n++] = ADDI(a7, zero, 93);
+    code[n++] = ECALL;
+
+    for (int i = 0; i < FUNCS; i++) {
+        code[FIRST + 2 * i] = ADDI(a0, a0, i % 7 + 1);
+        code[FIRST + 2 * i + 1] = JALR(zero, ra, 0);
+        sum += i % 7 + 1;
+    }
+
+    return run_guest("cache_flush", argv[1], code, sizeof(code) / sizeof(code[0]),
+                     argsets, sizeof(argsets) / sizeof(argsets[0]), (LOOPS * sum) & 0xff);
+}
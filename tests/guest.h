@@ -0,0 +1,113 @@
+/**
+ * what the tests share: an encoder for the few rv64 instructions their
+ * guests need, a writer for an elf that holds nothing but that code, and
+ * a runner that checks the exit code of the guest under several sets of
+ * options. the guests are written by the tests themselves, so no riscv
+ * toolchain is needed.
+ */
+#include <elf.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BASE 0x10000
+
+#define ITYPE(op, f3, rd, rs1, imm) \
+    ((op) | (rd) << 7 | (f3) << 12 | (rs1) << 15 | ((uint32_t)(imm) & 0xfff) << 20)
+#define ADDI(rd, rs1, imm) ITYPE(0x13, 0, rd, rs1, imm)
+#define JALR(rd, rs1, imm) ITYPE(0x67, 0, rd, rs1, imm)
+#define AUIPC(rd)          (0x17 | (rd) << 7)
+#define LUI(rd, imm)       (0x37 | (rd) << 7 | ((uint32_t)(imm) & ~0xfffu))
+#define LO12(imm)          ((((imm) & 0xfff) ^ 0x800) - 0x800)
+#define BNE(rs1, rs2, off) \
+    (0x63 | 1 << 12 | (rs1) << 15 | (rs2) << 20 | \
+     (((off) >> 11) & 1) << 7 | (((off) >> 1) & 0xf) << 8 | \
+     (((off) >> 5) & 0x3f) << 25 | (((off) >> 12) & 1) << 31)
+#define JAL(rd, off) \
+    (0x6f | (rd) << 7 | (((off) >> 12) & 0xff) << 12 | (((off) >> 11) & 1) << 20 | \
+     (((off) >> 1) & 0x3ff) << 21 | (((off) >> 20) & 1) << 31)
+#define ECALL 0x73
+
+enum { zero = 0, ra = 1, s0 = 8, a0 = 10, a7 = 17 };
+
+// an elf at path whose one segment is code, run from its start.
+static void write_elf(const char *path, const uint32_t *code, size_t ninsns) {
+    struct {
+        Elf64_Ehdr ehdr;
+        Elf64_Phdr phdr;
+    } hdr = {0};
+    size_t size = sizeof(hdr) + ninsns * sizeof(uint32_t);
+
+    memcpy(hdr.ehdr.e_ident, ELFMAG, SELFMAG);
+    hdr.ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    hdr.ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    hdr.ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    hdr.ehdr.e_type = ET_EXEC;
+    hdr.ehdr.e_machine = EM_RISCV;
+    hdr.ehdr.e_version = EV_CURRENT;
+    hdr.ehdr.e_entry = BASE + sizeof(hdr);
+    hdr.ehdr.e_phoff = sizeof(Elf64_Ehdr);
+    hdr.ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    hdr.ehdr.e_phentsize = sizeof(Elf64_Phdr);
+    hdr.ehdr.e_phnum = 1;
+
+    hdr.phdr.p_type = PT_LOAD;
+    hdr.phdr.p_flags = PF_R | PF_X;
+    hdr.phdr.p_vaddr = BASE;
+    hdr.phdr.p_filesz = hdr.phdr.p_memsz = size;
+    hdr.phdr.p_align = 0x1000;
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL || fwrite(&hdr, sizeof(hdr), 1, file) != 1 ||
+        fwrite(code, sizeof(uint32_t), ninsns, file) != ninsns || fclose(file) != 0) {
+        perror(path);
+        exit(1);
+    }
+}
+
+/**
+ * runs the guest in code with rvemu under each of the NULL terminated
+ * argsets, and reports whether it exits with expected every time.
+ */
+static int run_guest(const char *name, const char *rvemu, const uint32_t *code, size_t ninsns,
+                     const char *const argsets[][4], size_t nargsets, int expected) {
+    char path[] = "/tmp/rvemu-test-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+    write_elf(path, code, ninsns);
+
+    int failed = 0;
+    for (size_t i = 0; i < nargsets; i++) {
+        const char *args[8] = { rvemu };
+        int n = 1;
+        for (int j = 0; argsets[i][j] != NULL; j++) args[n++] = argsets[i][j];
+        args[n++] = "--no-disk-cache";
+        args[n++] = path;
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            execv(rvemu, (char **)args);
+            _exit(127);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        int rc = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+        printf("%s %s", rc == expected ? "ok  " : "FAIL", name);
+        for (int j = 1; j < n - 1; j++) printf(" %s", args[j]);
+        if (rc != expected) printf(": exit %d, expected %d", rc, expected);
+        printf("\n");
+        failed |= rc != expected;
+    }
+
+    unlink(path);
+    return failed;
+}
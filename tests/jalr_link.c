@@ -0,0 +1,40 @@
+/**
+ * calls through `auipc ra, 0; jalr ra, off(ra)`, where the jalr reads the
+ * register it links, in a loop long enough to be translated, and checks
+ * the exit code under every backend.
+ *
+ * usage: jalr_link <rvemu>
+ */
+#include "guest.h"
+
+#define LOOPS 100000
+
+static const uint32_t code[] = {
+    LUI(s0, LOOPS - LO12(LOOPS)), // 0:  s0 = LOOPS
+    ADDI(s0, s0, LO12(LOOPS)),    // 4
+    AUIPC(ra),                    // 8:  loop
+    JALR(ra, ra, 20),             // 12: call f, at 8 + 20
+    ADDI(s0, s0, -1),             // 16
+    BNE(s0, zero, -12),           // 20: to loop
+    JAL(zero, 12),                // 24: to exit
+    ADDI(a0, a0, 3),              // 28: f, a0 starts at 0
+    JALR(zero, ra, 0),            // 32
+    ADDI(a7, zero, 93),           // 36: exit(a0)
+    ECALL,
+};
+
+static const char *const argsets[][4] = {
+    { NULL },
+    { "-j0", NULL },
+    { "--jit=cp", NULL },
+    { "--jit=cp", "--verify", NULL },
+};
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <rvemu>\n", argv[0]);
+        return 1;
+    }
+    return run_guest("jalr_link", argv[1], code, sizeof(code) / sizeof(code[0]),
+                     argsets, sizeof(argsets) / sizeof(argsets[0]), (LOOPS * 3) & 0xff);
+}